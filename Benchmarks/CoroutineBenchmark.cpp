@@ -0,0 +1,93 @@
+/*
+ * Runs multiplications from C++20 coroutines on the thread pool: each pipeline
+ * continues as a pool job with co_await pool.Schedule(), then raises B to a power
+ * by co_awaiting MatMulAsync for every product, without blocking a thread between
+ * them. The products are checked against MatMul on the calling thread, and the
+ * time of all pipelines is reported. N = 1000, 4 pipelines of 4 products by default.
+ *
+ * This is the translation unit that builds the coroutine support of the pool
+ * (PoolTask, Schedule) and of MatMulFuture, it needs C++20 (stdcpp20).
+ *
+ * Only one benchmark of this project can define main, exclude the others to run this.
+ */
+#define MM_NO_MAIN
+#include "../MatrixMult/MatrixMul.cpp"
+#include "../MatrixMult/CPUUtil.cpp"
+
+#ifndef __cpp_impl_coroutine
+#error "CoroutineBenchmark needs C++20 coroutines, build it with /std:c++20"
+#endif
+
+/* out = B^(numProducts + 1), computed on the pool */
+static PoolTask Pipeline(const Mat& matB, const unsigned numProducts, Matrix& out,
+                         std::atomic<unsigned>& numDone)
+{
+    co_await GetThreadPool().Schedule();
+
+    Matrix product = co_await MatMulAsync(matB, matB);
+    for (unsigned i = 1; i < numProducts; ++i) {
+        product = co_await MatMulAsync(product, matB);
+    }
+    out = std::move(product);
+    ++numDone;
+}
+
+int main(int argc, char* argv[])
+{
+    const unsigned N = argc > 1 ? atoi(argv[1]) : 1000;
+    const unsigned numPipelines = argc > 2 ? atoi(argv[2]) : 4;
+    const unsigned numProducts = argc > 3 ? atoi(argv[3]) : 4;
+    assert(N > 0 && numPipelines > 0 && numProducts > 0);
+
+    /* entries of size 1/sqrt(N) keep the powers of B in range */
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1, 1);
+    const float scale = 1.0f / sqrtf((float)N);
+    std::vector<Matrix> matBs;
+    for (unsigned p = 0; p < numPipelines; ++p) {
+        matBs.emplace_back(N, N);
+        Matrix& matB = matBs.back();
+        for (unsigned i = 0; i < N * matB.View().rowSpan; ++i) {
+            matB.Data()[i] = (i % matB.View().rowSpan) < N ? dist(rng) * scale : 0;
+        }
+    }
+
+    std::vector<Matrix> results(numPipelines);
+    std::atomic<unsigned> numDone(0);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (unsigned p = 0; p < numPipelines; ++p) {
+        Pipeline(matBs[p], numProducts, results[p], numDone);
+    }
+    /* the pipelines run on the pool, this thread only waits for the last one */
+    while (numDone < numPipelines) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double maxRelErr = 0;
+    for (unsigned p = 0; p < numPipelines; ++p) {
+        Matrix ref = MatMul(matBs[p], matBs[p]);
+        for (unsigned i = 1; i < numProducts; ++i) {
+            ref = MatMul(ref, matBs[p]);
+        }
+        double err = 0, norm = 0;
+        const Mat& C = results[p];
+        for (unsigned row = 0; row < N; ++row) {
+            for (unsigned col = 0; col < N; ++col) {
+                const float expected = ref.View().mat[row * ref.View().rowSpan + col];
+                err = max(err, (double)fabsf(C.mat[row * C.rowSpan + col] - expected));
+                norm = max(norm, (double)fabsf(expected));
+            }
+        }
+        maxRelErr = max(maxRelErr, norm > 0 ? err / norm : err);
+    }
+
+    printf("%u pipelines of %u products, N=%u: %lld microseconds, max rel err %g\n",
+           numPipelines, numProducts, N,
+           (long long)std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+             .count(),
+           maxRelErr);
+
+    return maxRelErr < 1e-3 ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+/*
+ * Compares the job issue orders of the multithreaded MatMul (row order, Morton, Hilbert)
+ * on NxN matrices, 8K, 12K and 16K by default.
+ *
+ * For each order it reports the wall clock time of the multiplication and the L3 traffic
+ * of a model of the pool: cores pick jobs in issue order, so the A row bands and B^T
+ * row bands read by the jobs reach L3 in about that order. They're replayed through an
+ * LRU cache of L3Size bytes, one per L3 domain (core group of the pool) taking the jobs
+ * assigned to it, the bytes loaded into them are the modelled LLC misses.
+ * For hardware LLC miss counts, run the timed call under a profiler (VTune, Intel PCM),
+ * the model shows the same trend without one.
+ *
+ * Only one benchmark of this project can define main, exclude the others to run this.
+ */
+#define MM_NO_MAIN
+#include "../MatrixMult/MatrixMul.cpp"
+#include "../MatrixMult/CPUUtil.cpp"
+#include <list>
+
+/* Bytes loaded into L3 by the jobs of the plan, in the model above */
+static double ModelL3Traffic(const MatMulPlan& plan, const unsigned rowSpan)
+{
+    const MMBlockInfo& info = plan.mmBlockInfo;
+    const size_t bandBytesA = (size_t)info.issuedBlockSzY * rowSpan * sizeof(float);
+    const size_t bandBytesBT = (size_t)info.issuedBlockSzX * rowSpan * sizeof(float);
+
+    /* bands are keyed by their index, B^T bands have the top bit set */
+    constexpr uint64_t btBand = (uint64_t)1 << 63;
+    typedef struct L3Model {
+        std::list<std::pair<uint64_t, size_t>> lru;
+        std::unordered_map<uint64_t, std::list<std::pair<uint64_t, size_t>>::iterator>
+          cached;
+        size_t cachedBytes = 0;
+    } L3Model;
+    std::vector<L3Model> domains(
+      1 + *std::max_element(plan.jobGroups.begin(), plan.jobGroups.end()));
+    double traffic = 0;
+
+    auto Touch = [&](L3Model& l3, const uint64_t key, const size_t bytes) {
+        auto it = l3.cached.find(key);
+        if (it != l3.cached.end()) {
+            l3.lru.splice(l3.lru.begin(), l3.lru, it->second);
+            return;
+        }
+        traffic += bytes;
+        l3.lru.push_front({key, bytes});
+        l3.cached[key] = l3.lru.begin();
+        l3.cachedBytes += bytes;
+        while (l3.cachedBytes > (size_t)L3Size && l3.lru.size() > 1) {
+            l3.cachedBytes -= l3.lru.back().second;
+            l3.cached.erase(l3.lru.back().first);
+            l3.lru.pop_back();
+        }
+    };
+
+    for (size_t i = 0; i < plan.jobs.size(); ++i) {
+        L3Model& l3 = domains[plan.jobGroups[i]];
+        for (const MMJob& block : plan.jobs[i]) {
+            const unsigned w = block.full ? info.issuedBlockSzX : block.blockX;
+            const unsigned h = block.full ? info.issuedBlockSzY : block.blockY;
+            if (w <= 0 || h <= 0)
+                continue;
+            for (unsigned row = block.row; row < block.row + h; row += info.issuedBlockSzY) {
+                Touch(l3, row / info.issuedBlockSzY, bandBytesA);
+            }
+            for (unsigned col = block.col; col < block.col + w; col += info.issuedBlockSzX) {
+                Touch(l3, btBand | (col / info.issuedBlockSzX), bandBytesBT);
+            }
+        }
+    }
+
+    return traffic;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<unsigned> sizes = {8192, 12288, 16384};
+    if (argc > 1) {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i) {
+            sizes.push_back(atoi(argv[i]));
+            assert(sizes.back() > 0);
+        }
+    }
+
+    const char* orderNames[] = {"rows", "morton", "hilbert"};
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1, 1);
+
+    for (const unsigned N : sizes) {
+        Matrix matA(N, N), matB(N, N), matC(N, N);
+        for (unsigned i = 0; i < N * matA.View().rowSpan; ++i) {
+            matA.Data()[i] = (i % matA.View().rowSpan) < N ? dist(rng) : 0;
+            matB.Data()[i] = (i % matB.View().rowSpan) < N ? dist(rng) : 0;
+        }
+
+        for (const MMJobOrder order : {MM_ORDER_ROWS, MM_ORDER_MORTON, MM_ORDER_HILBERT}) {
+            mmJobOrder = order;
+            const MatMulPlan plan = MakeMatMulPlan(N, N, N);
+
+            auto start = std::chrono::high_resolution_clock::now();
+            ExecuteMatMulPlan(plan, matA, matB, matC);
+            auto end = std::chrono::high_resolution_clock::now();
+
+            printf("N=%u %-8s %10lld microseconds, modelled L3 traffic %.2f GB\n", N,
+                   orderNames[order],
+                   (long long)std::chrono::duration_cast<std::chrono::microseconds>(
+                     end - start)
+                     .count(),
+                   ModelL3Traffic(plan, matA.View().rowSpan) / 1e9);
+        }
+    }
+
+    return 0;
+}
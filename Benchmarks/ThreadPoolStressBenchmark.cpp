@@ -0,0 +1,134 @@
+/*
+ * Stress test of HWLocalThreadPool, run it after changing the pool's queues.
+ *
+ * Each round creates a pool and runs numProducers threads adding small jobs to it at
+ * once, over every group and priority class. They add in bursts longer than a queue
+ * ring (QUEUE_CAPACITY) s.t the rings overflow into the spill lists. Producers come in
+ * pairs sharing a batch, both of them wait for it with WaitBatch and claim its queued
+ * jobs concurrently with the cores. Some jobs add a job to their batch from the core,
+ * as task graphs do. Halfway through, AddPartition moves a quarter of the cores into
+ * a new partition while partition 0 is loaded, the later jobs go to either one.
+ *
+ * Every job has to run exactly once, the run fails otherwise. Jobs run by a core of
+ * another partition are reported: a core moved between taking a job and starting it
+ * counts too, so a few of them may show up in a round, not one per queued job.
+ *
+ * Only one benchmark of this project can define main, exclude the others to run this.
+ */
+#include "../MatrixMult/ThreadPool.h"
+#include "../MatrixMult/CPUUtil.cpp"
+#include <chrono>
+#include <random>
+
+typedef struct StressState {
+    HWLocalThreadPool* pool;
+    /* runs of each job, by id */
+    std::unique_ptr<std::atomic<unsigned>[]> runs;
+    std::atomic<unsigned> nextId{0};
+    std::atomic<unsigned> misplaced{0};
+    /* partition the producers add to besides 0, -1 until AddPartition returns */
+    std::atomic<int> partition{-1};
+    std::atomic<unsigned> numAdded{0};
+} StressState;
+
+/* Add a job to batch, it adds a child job to the batch if spawn is set */
+static void AddStressJob(StressState& state, HWLocalThreadPool::JobBatch* const batch,
+                         const unsigned group, const unsigned partition,
+                         const int priority, const bool spawn)
+{
+    const unsigned id = state.nextId++;
+    std::vector<std::function<void()>> job(state.pool->NumThreadsPerCore(), []() {});
+    job[0] = [&state, batch, group, partition, priority, spawn, id]() {
+        const int core = state.pool->CurrentCoreHandler();
+        if (core >= 0 && state.pool->PartitionOfCore(core) != partition)
+            ++state.misplaced;
+        ++state.runs[id];
+
+        /* a little work s.t the queues fill up */
+        volatile unsigned sink = id;
+        for (int i = 0; i < 200; ++i) {
+            sink = sink * 1664525 + 1013904223;
+        }
+        if (spawn)
+            AddStressJob(state, batch, group + 1, partition, priority, false);
+    };
+    state.pool->Add(job, group, batch, partition, priority);
+    ++state.numAdded;
+}
+
+static void Producer(StressState& state, HWLocalThreadPool::JobBatch* const batch,
+                     const unsigned numJobs, const unsigned seed)
+{
+    std::mt19937 rng(seed);
+    /* longer than a priority class' ring of a queue, QUEUE_CAPACITY */
+    const unsigned burst = 4096;
+    for (unsigned added = 0; added < numJobs;) {
+        for (unsigned i = 0; i < burst && added < numJobs; ++i, ++added) {
+            const int moved = state.partition;
+            const unsigned partition = (moved > 0 && rng() % 2) ? moved : 0;
+            AddStressJob(state, batch, rng() % state.pool->NumGroups(), partition,
+                         rng() % HWLocalThreadPool::NUM_PRIORITIES, rng() % 16 == 0);
+        }
+        std::this_thread::yield();
+    }
+    state.pool->WaitBatch(*batch);
+}
+
+int main(int argc, char* argv[])
+{
+    const unsigned numProducers = argc > 1 ? atoi(argv[1]) : 8;
+    const unsigned jobsPerProducer = argc > 2 ? atoi(argv[2]) : 20000;
+    const unsigned numRounds = argc > 3 ? atoi(argv[3]) : 10;
+    assert(numProducers > 0 && jobsPerProducer > 0);
+
+    bool failed = false;
+    for (unsigned round = 0; round < numRounds; ++round) {
+        HWLocalThreadPool pool(0, 0);
+        StressState state;
+        state.pool = &pool;
+        /* each job spawns at most one child */
+        const unsigned maxJobs = 2 * numProducers * jobsPerProducer;
+        state.runs.reset(new std::atomic<unsigned>[maxJobs]);
+        for (unsigned i = 0; i < maxJobs; ++i) {
+            state.runs[i] = 0;
+        }
+
+        std::vector<HWLocalThreadPool::JobBatch> batches((numProducers + 1) / 2);
+        std::vector<std::thread> producers;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (unsigned i = 0; i < numProducers; ++i) {
+            producers.emplace_back(Producer, std::ref(state), &batches[i / 2],
+                                   jobsPerProducer, round * numProducers + i);
+        }
+
+        /* move cores while partition 0 is loaded */
+        const unsigned numMoved = pool.NumCoreHandlers() / 4;
+        while (state.numAdded < numProducers * jobsPerProducer / 2) {
+            std::this_thread::yield();
+        }
+        if (numMoved > 0)
+            state.partition = pool.AddPartition("stress", numMoved);
+
+        for (auto& producer : producers) {
+            producer.join();
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        pool.Close();
+
+        const unsigned numJobs = state.nextId;
+        unsigned numWrong = 0;
+        for (unsigned i = 0; i < numJobs; ++i) {
+            numWrong += state.runs[i] != 1;
+        }
+        const long long us =
+          std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        printf("round %u: %u jobs, %lld microseconds, %.2f M jobs/s, moved %u cores, "
+               "%u not run once, %u on another partition\n",
+               round, numJobs, us, numJobs / (double)(us > 0 ? us : 1), numMoved,
+               numWrong, state.misplaced.load());
+        failed |= numWrong > 0;
+    }
+
+    return failed ? 1 : 0;
+}
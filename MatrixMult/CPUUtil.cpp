@@ -9,6 +9,10 @@ namespace CPUUtil
         static int logicalProcInfoCached = 0;
         static unsigned numHWCores, numLogicalProcessors;
         static ULONG_PTR* physLogicalProcessorMap = NULL;
+        static unsigned numL3Domains;
+        static ULONG_PTR* l3DomainMasks = NULL;
+        static int* l3DomainSizes = NULL;
+        static ULONG_PTR processAffinityMask = ~(ULONG_PTR)0;
 
         void PrintSysLPInfoArr(_SYSTEM_LOGICAL_PROCESSOR_INFORMATION* const sysLPInf,
                                const DWORD& retLen)
@@ -71,36 +75,104 @@ namespace CPUUtil
 
         DWORD _GetSysLPMap(unsigned& numHWCores)
         {
-            // These assumptions should never fail on desktop
-            const unsigned N = 48, M = 48;
-
-            _SYSTEM_LOGICAL_PROCESSOR_INFORMATION sysLPInf[N];
-            DWORD retLen = N * sizeof(_SYSTEM_LOGICAL_PROCESSOR_INFORMATION);
-            LOGICAL_PROCESSOR_RELATIONSHIP lpRel = RelationProcessorCore;
-
-            static BOOL retCode = GetLogicalProcessorInformation(&sysLPInf[0], &retLen);
+            /* Ask for the required length first, EPYC and Xeon parts report far more
+             * cache and core entries than a fixed array on the stack can hold. */
+            DWORD retLen = 0;
+            if (!GetLogicalProcessorInformation(NULL, &retLen) &&
+                GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+                return GetLastError();
+            }
 
-            if (!retCode) {
+            _SYSTEM_LOGICAL_PROCESSOR_INFORMATION* const sysLPInf =
+              (_SYSTEM_LOGICAL_PROCESSOR_INFORMATION*)malloc(retLen);
+            if (!GetLogicalProcessorInformation(sysLPInf, &retLen)) {
+                free(sysLPInf);
                 return GetLastError();
             }
+            const unsigned numEntries =
+              retLen / sizeof(_SYSTEM_LOGICAL_PROCESSOR_INFORMATION);
+
+            free(physLogicalProcessorMap);
+            free(l3DomainMasks);
+            free(l3DomainSizes);
+            physLogicalProcessorMap =
+              (ULONG_PTR*)malloc(numEntries * sizeof(ULONG_PTR));
+            l3DomainMasks = (ULONG_PTR*)malloc(numEntries * sizeof(ULONG_PTR));
+            l3DomainSizes = (int*)malloc(numEntries * sizeof(int));
+
+            DWORD_PTR processMask, systemMask;
+            if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+                processAffinityMask = processMask;
+
+            numHWCores = numLogicalProcessors = numL3Domains = 0;
+            for (unsigned i = 0; i < numEntries; ++i) {
+                if (sysLPInf[i].Relationship == RelationProcessorCore) {
+                    ULONG_PTR logicalProcessorMask = sysLPInf[i].ProcessorMask;
+                    physLogicalProcessorMap[numHWCores++] = logicalProcessorMask;
+                    numLogicalProcessors += NumSetBits(logicalProcessorMask);
+                } else if (sysLPInf[i].Relationship == RelationCache &&
+                           sysLPInf[i].Cache.Level == 3 &&
+                           sysLPInf[i].Cache.Type != CacheInstruction) {
+                    /* One entry per L3 instance, e.g. per CCX on Zen, per
+                     * sub-NUMA cluster on Xeon with SNC enabled. */
+                    l3DomainMasks[numL3Domains] = sysLPInf[i].ProcessorMask;
+                    l3DomainSizes[numL3Domains++] = sysLPInf[i].Cache.Size;
+                }
+            }
+            free(sysLPInf);
+
+            /* No L3 reported, treat the whole system as a single domain */
+            if (!numL3Domains) {
+                l3DomainMasks[0] = 0;
+                for (unsigned i = 0; i < numHWCores; ++i)
+                    l3DomainMasks[0] |= physLogicalProcessorMap[i];
+                l3DomainSizes[0] = 0;
+                numL3Domains = 1;
+            }
+
+            return 0;
+        }
 
-            ULONG_PTR* const lMap = (ULONG_PTR*)malloc(M * sizeof(ULONG_PTR));
+        static int* coreTypes = NULL;
 
-            numHWCores = 0;
-            for (int i = 0; i * sizeof(_SYSTEM_LOGICAL_PROCESSOR_INFORMATION) <= retLen;
-                 ++i) {
-                if (sysLPInf[i].Relationship != RelationProcessorCore)
+        /* cpuid leaf 0x1A only describes the core executing it, so run it once on each
+         * core by moving the calling thread around, then restore its affinity. */
+        int _CacheCoreTypes()
+        {
+            if (coreTypes)
+                return 0;
+
+            int* const types = (int*)malloc(numHWCores * sizeof(int));
+            const int hybrid = GetHybridStatus();
+            for (unsigned n = 0; n < numHWCores; ++n) {
+                types[n] = CORE_TYPE_PERFORMANCE;
+                if (!hybrid)
                     continue;
 
-                ULONG_PTR logicalProcessorMask = sysLPInf[i].ProcessorMask;
-                lMap[numHWCores++] = logicalProcessorMask;
-                numLogicalProcessors += NumSetBits(logicalProcessorMask);
+                /* lowest logical processor of the core */
+                const ULONG_PTR mask = physLogicalProcessorMap[n];
+                const DWORD_PTR prevMask =
+                  SetThreadAffinityMask(GetCurrentThread(), mask & (~mask + 1));
+                int cpui[4];
+                __cpuidex(cpui, 0x1A, 0);
+                /* EAX[31:24], 0x20: Intel Atom, 0x40: Intel Core */
+                if (((unsigned)cpui[0] >> 24) == 0x20)
+                    types[n] = CORE_TYPE_EFFICIENCY;
+                if (prevMask)
+                    SetThreadAffinityMask(GetCurrentThread(), prevMask);
             }
+            coreTypes = types;
 
-            physLogicalProcessorMap = (ULONG_PTR*)malloc(numHWCores * sizeof(ULONG_PTR));
-            memcpy(physLogicalProcessorMap, lMap, numHWCores * sizeof(ULONG_PTR));
-            free(lMap);
+            return 0;
+        }
 
+        int _CacheLPMap()
+        {
+            if (!logicalProcInfoCached) {
+                if (_GetSysLPMap(numHWCores))
+                    return -1;
+                logicalProcInfoCached = 1;
+            }
             return 0;
         }
     } // private namespace
@@ -158,6 +230,129 @@ namespace CPUUtil
         return 0;
     }
 
+    int GetNumCoreThreads(unsigned n)
+    {
+        if (_CacheLPMap() || n >= numHWCores)
+            return -1;
+        return NumSetBits(physLogicalProcessorMap[n] & processAffinityMask);
+    }
+
+    int GetNumAvailableHWCores()
+    {
+        if (_CacheLPMap())
+            return -1;
+
+        int numAvailable = 0;
+        for (unsigned i = 0; i < numHWCores; ++i) {
+            numAvailable += (physLogicalProcessorMap[i] & processAffinityMask) != 0;
+        }
+        return numAvailable;
+    }
+
+    int GetAvailableHWCore(unsigned n)
+    {
+        if (_CacheLPMap())
+            return -1;
+
+        for (unsigned i = 0; i < numHWCores; ++i) {
+            if (!(physLogicalProcessorMap[i] & processAffinityMask))
+                continue;
+            if (n-- == 0)
+                return i;
+        }
+        return -1;
+    }
+
+    double GetCPUQuota()
+    {
+        /* CpuRate and MaxRate are in 1/100 percent of all processors' cycles */
+        JOBOBJECT_CPU_RATE_CONTROL_INFORMATION rateInfo;
+        if (!QueryInformationJobObject(NULL, JobObjectCpuRateControlInformation,
+                                       &rateInfo, sizeof(rateInfo), NULL)) {
+            return 0;
+        }
+        if (!(rateInfo.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_ENABLE))
+            return 0;
+
+        unsigned rate = 0;
+        if (rateInfo.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP)
+            rate = rateInfo.CpuRate;
+        else if (rateInfo.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_MIN_MAX_RATE)
+            rate = rateInfo.MaxRate;
+        if (!rate)
+            return 0;
+
+        /* GetNumLogicalProcessors counts the whole system, as the rate does */
+        return rate / 10000.0 * GetNumLogicalProcessors();
+    }
+
+    int GetNumL3Domains()
+    {
+        if (_CacheLPMap())
+            return -1;
+        return numL3Domains;
+    }
+
+    int GetL3DomainMask(unsigned d, ULONG_PTR& mask)
+    {
+        if (_CacheLPMap())
+            return -1;
+        if (d >= numL3Domains)
+            return -1;
+
+        mask = l3DomainMasks[d];
+
+        return 0;
+    }
+
+    int GetL3DomainSize(unsigned d)
+    {
+        if (_CacheLPMap() || d >= numL3Domains)
+            return -1;
+        return l3DomainSizes[d];
+    }
+
+    int GetCoreL3Domain(unsigned n)
+    {
+        if (_CacheLPMap() || n >= numHWCores)
+            return -1;
+
+        for (unsigned d = 0; d < numL3Domains; ++d) {
+            if (l3DomainMasks[d] & physLogicalProcessorMap[n])
+                return d;
+        }
+        return 0;
+    }
+
+    int GetHybridStatus()
+    {
+        /* cpuid leaf 7, EDX[15] */
+        int cpui[4];
+        __cpuid(cpui, 0);
+        if (cpui[0] < 7)
+            return 0;
+        __cpuidex(cpui, 7, 0);
+        return (cpui[3] >> 15) & 1;
+    }
+
+    int GetCoreType(unsigned n)
+    {
+        if (_CacheLPMap() || n >= numHWCores)
+            return -1;
+        _CacheCoreTypes();
+        return coreTypes[n];
+    }
+
+    int GetCoreCapacity(unsigned n)
+    {
+        /* Efficiency cores (Gracemont) have 128 bit FMA units and lower clocks,
+         * about half the AVX2 throughput of a performance core */
+        const int type = GetCoreType(n);
+        if (type < 0)
+            return -1;
+        return type == CORE_TYPE_EFFICIENCY ? 512 : 1024;
+    }
+
     /* Returns decimal value for a 32 bit mask at compile time, [i:j] set to 1, rest are 0. */
     constexpr int GenerateMask(int i, int j)
     {
@@ -167,6 +362,27 @@ namespace CPUUtil
             return (1 << (j + 1)) - (1 << i);
     }
 
+    /* Cache sizes of AMD CPUs without leaf 0x8000001D, from the AMD64 Architecture
+     * Programmer's Manual, Vol. 3:
+     * 0x80000005: ECX[31:24] L1 data cache KB, EDX[31:24] L1 instruction cache KB
+     * 0x80000006: ECX[31:16] L2 KB, EDX[31:18] L3 (shared by all cores) in 512KB
+     * units */
+    static void GetLegacyAMDCacheInfo(const unsigned maxExtLeaf, int* dCaches,
+                                      int& iCache)
+    {
+        int cpui[4];
+        if (maxExtLeaf >= 0x80000005) {
+            __cpuid(cpui, 0x80000005);
+            dCaches[0] = ((unsigned)cpui[2] >> 24) * 1024;
+            iCache = ((unsigned)cpui[3] >> 24) * 1024;
+        }
+        if (maxExtLeaf >= 0x80000006) {
+            __cpuid(cpui, 0x80000006);
+            dCaches[1] = ((unsigned)cpui[2] >> 16) * 1024;
+            dCaches[2] = ((unsigned)cpui[3] >> 18) * 512 * 1024;
+        }
+    }
+
     void GetCacheInfo(int* dCaches, int& iCache)
     {
         /*
@@ -178,14 +394,41 @@ namespace CPUUtil
         *                                  * (Line size + 1) * (Sets + 1)
         *                     = (EBX[31:22]+1) * (EBX[21:12]+1)
         *                                      * (EBX[11:0]+1) * (ECX+1)
-        * For now, this function assumes we're on a modern Intel CPU
-        * So we have L1,2,3 data caches and first level instruction cache
+        * AMD reports the same layout in leaf 0x8000001D and leaves leaf 4 zeroed,
+        * so that's queried instead on AMD. The leaf only exists with the topology
+        * extensions (TOPOEXT, CPUID 0x80000001 ECX[22]), older AMD CPUs report the
+        * sizes in KB in leaves 0x80000005 (L1) and 0x80000006 (L2, L3), see
+        * GetLegacyAMDCacheInfo.
+        * We expect L1,2,3 data caches and first level instruction cache.
+        * The sizes are per cache instance, so L3 is the size of one CCX's L3 on Zen.
+        * Caches that aren't reported are 0.
         */
 
+        dCaches[0] = dCaches[1] = dCaches[2] = 0;
+        iCache = 0;
+
         int cpui[4];
+        __cpuid(cpui, 0);
+        const int isAMD = cpui[1] == 0x68747541 /* Auth */ &&
+                          cpui[3] == 0x69746e65 /* enti */ &&
+                          cpui[2] == 0x444d4163 /* cAMD */;
+        if (isAMD) {
+            __cpuid(cpui, 0x80000000);
+            const unsigned maxExtLeaf = cpui[0];
+            int topoExt = 0;
+            if (maxExtLeaf >= 0x80000001) {
+                __cpuid(cpui, 0x80000001);
+                topoExt = (cpui[2] >> 22) & 1;
+            }
+            if (!topoExt || maxExtLeaf < 0x8000001D) {
+                GetLegacyAMDCacheInfo(maxExtLeaf, dCaches, iCache);
+                return;
+            }
+        }
+        const int leaf = isAMD ? 0x8000001D : 4;
 
         for (int i = 0, dc = 0; i < 4; ++i) {
-            __cpuidex(cpui, 4, i);
+            __cpuidex(cpui, leaf, i);
             int sz = (((cpui[1] & GenerateMask(31, 22)) >> 22) + 1) *
                      (((cpui[1] & GenerateMask(21, 12)) >> 12) + 1) *
                      ((cpui[1] & GenerateMask(11, 0)) + 1) * (cpui[2] + 1);
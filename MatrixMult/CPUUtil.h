@@ -18,8 +18,50 @@ namespace CPUUtil
     /* Get the logical processor mask corresponding to the Nth hardware core */
     int GetProcessorMask(unsigned n, ULONG_PTR& mask);
 
+    /* Get number of logical processors of the Nth hardware core the process may run on,
+     * 1 if it has no HT */
+    int GetNumCoreThreads(unsigned n);
+
+    /* Get number of hardware cores with a logical processor in the process affinity
+     * mask, the cores a container or a restricted process may run on */
+    int GetNumAvailableHWCores();
+
+    /* Get the hardware core index of the Nth available core, -1 on error */
+    int GetAvailableHWCore(unsigned n);
+
+    /* Query the CPU time the process may use in CPUs' worth, from the CPU rate hard cap
+     * of the job object it runs in (e.g. a container's CPU limit), 0 if not capped */
+    double GetCPUQuota();
+
+    /* Get number of L3 cache domains, sets of cores sharing one L3 instance
+     * (a CCX on AMD Zen, a sub-NUMA cluster on Xeon with SNC).
+     * 1 if L3 isn't reported. */
+    int GetNumL3Domains();
+
+    /* Get the logical processor mask of the Dth L3 domain */
+    int GetL3DomainMask(unsigned d, ULONG_PTR& mask);
+
+    /* Get the L3 size in bytes of the Dth L3 domain, 0 if unknown */
+    int GetL3DomainSize(unsigned d);
+
+    /* Get the L3 domain index of the Nth hardware core */
+    int GetCoreL3Domain(unsigned n);
+
+    /* Core types of hybrid CPUs, all cores of a non hybrid CPU are performance cores */
+    enum CoreType { CORE_TYPE_PERFORMANCE = 0, CORE_TYPE_EFFICIENCY = 1 };
+
+    /* Query whether the runtime system has performance and efficiency cores */
+    int GetHybridStatus();
+
+    /* Get the CoreType of the Nth hardware core, -1 on error */
+    int GetCoreType(unsigned n);
+
+    /* Get the relative AVX throughput of the Nth hardware core, 1024 for performance
+     * cores, on the same scale as Linux's cpu_capacity */
+    int GetCoreCapacity(unsigned n);
+
     /* Fill dCaches with L1,2,3 data cache sizes, 
-     * and iCache with L1 dedicated instruction cache size. */
+     * and iCache with L1 dedicated instruction cache size, 0 if not reported. */
     void GetCacheInfo(int* dCaches, int& iCache);
 
     /* Query cache line size on the current system. */
@@ -10,8 +10,15 @@
 #include <cstdio>
 #include <memory>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <numeric>
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <unordered_map>
+#include <type_traits>
 #include <xmmintrin.h>
 #include <emmintrin.h>
 #include <immintrin.h>
@@ -26,15 +33,182 @@ int L2Size = 256 * 1024;
 int L3Size = 12 * 1024 * 1024;
 int cacheLineSz = 64;
 int numHWCores = 6;
+/* how many L2 blocks ahead the L2 prefetches run, set per CPU unless overridden by
+ * SetL2PrefetchDistance */
+int L2PrefetchDistance = 1;
+int L2PrefetchDistanceOverride = 0;
+
+/* SMT helper thread mode, on HTT enabled CPUs one thread of each core computes and
+ * its sibling prefetches the next L2 blocks for it, instead of both computing.
+ * Pays off on memory bound shapes and older CPUs, see SetHTHelperMode. */
+int htHelperMode = 0;
+
+/* Enable or disable the SMT helper thread mode for the plans made from now on. */
+void SetHTHelperMode(const int enable)
+{
+    htHelperMode = enable;
+}
+
+/* Thread pool partition the plans made by this thread run on, see CreateMatMulPartition.
+ * Per thread, s.t e.g each tenant's threads of a service target their own cores. */
+thread_local unsigned mmPartition = 0;
+
+/* Run the multiplications planned by the calling thread from now on in the given
+ * partition, 0 is the default partition holding the cores of no other partition. */
+void SetMatMulPartition(const unsigned partition)
+{
+    mmPartition = partition;
+}
+
+/* Thread pool priority class of the plans made by this thread, see SetMatMulPriority */
+thread_local int mmPriority = HWLocalThreadPool::PRIORITY_NORMAL;
+
+/* Jobs per core of its partition a multiplication keeps queued at most. The rest are
+ * issued as these complete, s.t a higher priority multiplication started meanwhile only
+ * waits for the running blocks instead of the whole queue. */
+constexpr unsigned mmIssueWindow = 2;
+
+/* Run the multiplications planned by the calling thread from now on in the given
+ * priority class of the pool (HWLocalThreadPool::PRIORITY_LOW/NORMAL/HIGH). Their jobs
+ * are taken before the queued jobs of lower classes, e.g a latency critical product
+ * overtakes a running batch product after at most one block per core. */
+void SetMatMulPriority(const int priority)
+{
+    assert(priority >= 0 && priority < HWLocalThreadPool::NUM_PRIORITIES);
+    mmPriority = priority;
+}
+
+/* Size of the shared thread pool, physical cores and threads per core.
+ * By default the cores available to the process, cut down to its CPU quota,
+ * the explicit sizes given to SetThreadPoolSize otherwise. */
+int poolCores = 6, poolThreadsPerCore = 1;
+int poolCoresOverride = 0, poolThreadsOverride = 0;
+/* A job of MTMatMulBT is two blocks, one per thread of the core, more threads per
+ * core would idle (e.g. 4-way SMT). */
+constexpr int maxPoolThreadsPerCore = 2;
+int threadPoolCreated = 0;
+
+/* Size the thread pool, see poolCores. */
+static void MMHelper_SizeThreadPool()
+{
+    const int availableCores = CPUUtil::GetNumAvailableHWCores();
+    int cores = availableCores > 0 ? availableCores : numHWCores;
+    int threads = 1 << CPUUtil::GetHTTStatus();
+
+    /* A CPU quota below the available logical processors throttles the process once
+     * all of them are busy. SMT siblings count against the quota as much as cores but
+     * add little to the FMA throughput, so they go first, then cores. */
+    const double quota = CPUUtil::GetCPUQuota();
+    if (quota > 0 && quota < cores * threads) {
+        threads = 1;
+        cores = max(1, min(cores, (int)(quota + 0.5)));
+    }
+
+    poolCores = poolCoresOverride > 0 ? poolCoresOverride : cores;
+    poolThreadsPerCore = min(poolThreadsOverride > 0 ? poolThreadsOverride : threads,
+                             maxPoolThreadsPerCore);
+    numHWCores = poolCores;
+}
+
+/* Set L2PrefetchDistance. L2 blocks are sized to L2 already, only a large (1MB+,
+ * server) L2 has room for prefetching 2 blocks ahead by default. */
+static void MMHelper_SizeL2Prefetch()
+{
+    L2PrefetchDistance = L2PrefetchDistanceOverride > 0 ? L2PrefetchDistanceOverride
+                                                        : L2Size >= 1024 * 1024 ? 2 : 1;
+}
+
+/* Query the runtime system for the CPU related variables above, only once. */
+static void QueryCPUInfo()
+{
+    if (CPUInfoQueried)
+        return;
+
+    int dCaches[3];
+    int iCache;
+
+    CPUUtil::GetCacheInfo(&dCaches[0], iCache);
+
+    /* keep the defaults for the caches the CPU doesn't report */
+    if (dCaches[1] > 0)
+        L2Size = dCaches[1];
+    if (dCaches[2] > 0)
+        L3Size = dCaches[2];
+
+    /* L3 blocks are computed by the cores of a single L3 domain, so they're sized
+     * for the smallest L3 instance the OS reports, not the sum of them */
+    for (int d = 0; d < CPUUtil::GetNumL3Domains(); ++d) {
+        const int domainL3Size = CPUUtil::GetL3DomainSize(d);
+        if (domainL3Size > 0 && domainL3Size < L3Size)
+            L3Size = domainL3Size;
+    }
+
+    cacheLineSz = CPUUtil::GetCacheLineSize();
+
+    const int hwCores = CPUUtil::GetNumHWCores();
+    if (hwCores > 0)
+        numHWCores = hwCores;
+
+    MMHelper_SizeThreadPool();
+    MMHelper_SizeL2Prefetch();
+
+    CPUInfoQueried++;
+}
+
+/*
+ * Override how many L2 blocks ahead the L2 prefetches run, 0 restores the default for
+ * the CPU. Takes effect for the multiplications started from then on.
+ */
+void SetL2PrefetchDistance(const int distance)
+{
+    assert(distance >= 0);
+    L2PrefetchDistanceOverride = distance;
+    if (CPUInfoQueried)
+        MMHelper_SizeL2Prefetch();
+}
+
+/*
+ * Order the L3 blocks of C are issued to the thread pool in. Cores pick jobs in issue
+ * order, so along a space filling curve the blocks in flight at the same time are
+ * close to each other and share their A rows and B^T rows in L3, unlike in row order,
+ * where a row of L3 blocks walks all of B^T before reusing any of it.
+ */
+enum MMJobOrder { MM_ORDER_ROWS = 0, MM_ORDER_MORTON = 1, MM_ORDER_HILBERT = 2 };
+MMJobOrder mmJobOrder = MM_ORDER_HILBERT;
 
 /* Prefetching switches, if multiple MatMul operations are intended to run in parallel,
  * individual mutexes should be created for each one. */
 constexpr int doL3Prefetch = 0;
+constexpr int doL2Prefetch = 1;
 constexpr int doL12Prefetch = 0;
 int prefetched[1024][1024];
 std::mutex prefetchMutex;
 
-/* Matrix structure */
+/* Products below this complexity (N*M*K) are computed by the single threaded method. */
+constexpr unsigned STMatMulThreshold = 350 * 350 * 350;
+
+/* Limits of the issued block sizes, the size of the tile the lines shared between L2
+ * blocks are gathered in when C is streamed. L3 blocks are at most 360x360, split into
+ * 4 columns and 3 rows. */
+constexpr unsigned maxTileX = 96;
+constexpr unsigned maxTileY = 120;
+
+/* Wall clock time of the phases of the last MatMul issued from this thread, in
+ * microseconds. Phases that didn't take place are 0. */
+typedef struct MMPhaseTimes {
+    double firstTouch;
+    double transpose;
+    double multiply;
+} MMPhaseTimes;
+thread_local MMPhaseTimes mmPhaseTimes;
+
+/* Large page switch, pooled buffers of at least largePageMinAlloc bytes are backed by
+ * large pages when the process is allowed to lock pages in memory. */
+constexpr int doLargePages = 1;
+constexpr size_t largePageMinAlloc = 8 * 1024 * 1024;
+
+/* Matrix structure
+ * Columns [width, rowSpan) are padding and are expected to be zero. */
 typedef struct Mat {
     unsigned width;
     unsigned height;
@@ -58,8 +232,441 @@ typedef struct MMBlockInfo {
     const unsigned issuedBlockSzX, issuedBlockSzY;
 } MMBlockInfo;
 
+/* Zero the padding columns [width, rowSpan) of every row of the given matrix.
+ * The SIMD kernels run over whole vectors, so they read into the padding of A and BT. */
+static void ZeroMatPadding(const Mat& mat)
+{
+    if (mat.rowSpan == mat.width)
+        return;
+    for (int row = 0; row < mat.height; ++row) {
+        memset(&mat.mat[row * mat.rowSpan + mat.width], 0,
+               (mat.rowSpan - mat.width) * sizeof(float));
+    }
+}
+
+/* Round a given number to the nearest multiple of K,
+* where K is a parameter and is a power of 2 */
+static unsigned RoundUpPwr2(unsigned val, unsigned pwr2)
+{
+    return (val + (pwr2 - 1)) & (~(pwr2 - 1));
+}
+
+/*
+ * Allocator interface for matrix buffers, Alloc must return AVX_ALIGN aligned memory.
+ * Every buffer the library allocates (matrices, transposes, intermediates) goes through
+ * the allocator set by SetMatAllocator, so buffers can be pooled or placed specially.
+ */
+class MatAllocator {
+public:
+    virtual ~MatAllocator()
+    {
+    }
+    virtual void* Alloc(const size_t size) = 0;
+    virtual void Free(void* const ptr) = 0;
+};
+
+/* Plain _aligned_malloc / _aligned_free */
+class AlignedMallocAllocator : public MatAllocator {
+public:
+    void* Alloc(const size_t size) override
+    {
+        return _aligned_malloc(size, AVX_ALIGN);
+    }
+    void Free(void* const ptr) override
+    {
+        _aligned_free(ptr);
+    }
+};
+
+/* Large pages need SeLockMemoryPrivilege ("Lock pages in memory" user right) enabled on
+ * the process token. Tried once, returns the large page size or 0 if they can't be used. */
+static size_t MMHelper_LargePageSize()
+{
+    static const size_t largePageSz = []() -> size_t {
+        const size_t pageSz = GetLargePageMinimum();
+        HANDLE token;
+        if (!pageSz
+            || !OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY,
+                                 &token))
+            return 0;
+
+        TOKEN_PRIVILEGES privileges;
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        /* AdjustTokenPrivileges succeeds even if the privilege isn't held, it's only
+         * reported through the last error */
+        const int enabled =
+          LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+          && AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL)
+          && GetLastError() == ERROR_SUCCESS;
+        CloseHandle(token);
+
+        return enabled ? pageSz : 0;
+    }();
+    return largePageSz;
+}
+
+/* Allocate size bytes, with large pages if possible. Large page allocations fail once
+ * physical memory is fragmented, then regular pages are used. */
+static void* MMHelper_AllocPages(const size_t size, int& largePages)
+{
+    largePages = 0;
+    if constexpr (doLargePages) {
+        const size_t largePageSz = size >= largePageMinAlloc ? MMHelper_LargePageSize() : 0;
+        if (largePageSz) {
+            void* const ptr = VirtualAlloc(NULL,
+                                           (size + largePageSz - 1) / largePageSz * largePageSz,
+                                           MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                                           PAGE_READWRITE);
+            if (ptr) {
+                largePages = 1;
+                return ptr;
+            }
+        }
+    }
+    void* const ptr = _aligned_malloc(size, AVX_ALIGN);
+    assert(ptr);
+    return ptr;
+}
+
+static void MMHelper_FreePages(void* const ptr, const int largePages)
+{
+    if (largePages) {
+        VirtualFree(ptr, 0, MEM_RELEASE);
+    } else {
+        _aligned_free(ptr);
+    }
+}
+
+/*
+ * Size class pool of aligned buffers, the default allocator.
+ * Freed buffers are cached per size class and handed out again, instead of going back
+ * to the OS. Multi-hundred MB buffers are returned to the OS by the CRT on every free
+ * and paid for again with page faults on the next call, a pooled buffer stays warm.
+ * Cached memory is limited by a cap, buffers that don't fit under it are released,
+ * Trim() releases the cache on demand. Buffers of largePageMinAlloc bytes or more are
+ * backed by large pages when possible, cutting TLB misses on the strided B^T panel
+ * reads. Thread safe.
+ */
+class MatBufferPool : public MatAllocator {
+public:
+    MatBufferPool(const size_t capacity) : m_capacity(capacity), m_cachedBytes(0)
+    {
+    }
+
+    ~MatBufferPool()
+    {
+        Trim(0);
+    }
+
+    void* Alloc(const size_t size) override
+    {
+        const size_t sizeClass = SizeClass(size);
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        PoolBuffer buffer;
+        auto cached = m_cache.find(sizeClass);
+        if (cached != m_cache.end() && !cached->second.empty()) {
+            buffer = cached->second.back();
+            cached->second.pop_back();
+            m_cachedBytes -= sizeClass;
+            buffer.fresh = 0;
+        } else {
+            buffer.sizeClass = sizeClass;
+            buffer.ptr = MMHelper_AllocPages(sizeClass, buffer.largePages);
+            /* large pages are committed and resident from the start */
+            buffer.fresh = !buffer.largePages;
+        }
+
+        m_live[buffer.ptr] = buffer;
+        return buffer.ptr;
+    }
+
+    void Free(void* const ptr) override
+    {
+        if (!ptr)
+            return;
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        auto live = m_live.find(ptr);
+        assert(live != m_live.end());
+        const PoolBuffer buffer = live->second;
+        m_live.erase(live);
+
+        if (m_cachedBytes + buffer.sizeClass > m_capacity) {
+            MMHelper_FreePages(buffer.ptr, buffer.largePages);
+            return;
+        }
+        m_cache[buffer.sizeClass].push_back(buffer);
+        m_cachedBytes += buffer.sizeClass;
+    }
+
+    /* Release cached buffers back to the OS until at most keepBytes are cached,
+     * largest ones first. */
+    void Trim(const size_t keepBytes = 0)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (auto it = m_cache.rbegin(); it != m_cache.rend() && m_cachedBytes > keepBytes;
+             ++it) {
+            while (!it->second.empty() && m_cachedBytes > keepBytes) {
+                MMHelper_FreePages(it->second.back().ptr, it->second.back().largePages);
+                it->second.pop_back();
+                m_cachedBytes -= it->first;
+            }
+        }
+    }
+
+    /* Limit the memory kept cached, trims the cache if it's over the new limit. */
+    void SetCapacity(const size_t capacity)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_capacity = capacity;
+        }
+        Trim(capacity);
+    }
+
+    size_t CachedBytes()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_cachedBytes;
+    }
+
+    /* Whether a buffer handed out by the pool is backed by large pages */
+    int IsLargePage(const void* const ptr)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto live = m_live.find(const_cast<void*>(ptr));
+        return live != m_live.end() && live->second.largePages;
+    }
+
+    /* Whether a buffer handed out by the pool is new from the OS, i.e its pages are
+     * not faulted in yet. Only the first call tells, it's up to the caller to fault
+     * them in, see AllocMat. */
+    int TakeFresh(const void* const ptr)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto live = m_live.find(const_cast<void*>(ptr));
+        if (live == m_live.end() || !live->second.fresh)
+            return 0;
+        live->second.fresh = 0;
+        return 1;
+    }
+
+protected:
+    /* Round the size up to its size class. Above 4KB there are 4 classes per power of 2,
+     * so at most 25% of a buffer is wasted. */
+    static size_t SizeClass(const size_t size)
+    {
+        if (size <= 4096)
+            return (size + 63) & ~(size_t)63;
+
+        size_t pwr2 = 4096;
+        while (pwr2 <= size / 2) {
+            pwr2 *= 2;
+        }
+        const size_t step = pwr2 / 4;
+        return (size + step - 1) / step * step;
+    }
+
+private:
+    typedef struct PoolBuffer {
+        void* ptr;
+        size_t sizeClass;
+        int largePages;
+        int fresh;
+    } PoolBuffer;
+
+    size_t m_capacity, m_cachedBytes;
+    /* size class -> cached buffers */
+    std::map<size_t, std::vector<PoolBuffer>> m_cache;
+    /* buffers handed out */
+    std::unordered_map<void*, PoolBuffer> m_live;
+    std::mutex m_mutex;
+};
+
+/* Memory the default buffer pool may keep cached */
+constexpr size_t defaultPoolCapacity = (size_t)1 << 30;
+
+namespace
+{
+    MatBufferPool defaultMatAllocator(defaultPoolCapacity);
+    MatAllocator* matAllocator = &defaultMatAllocator;
+} // namespace
+
+/* The default allocator, to set its capacity or trim it. */
+MatBufferPool& GetMatBufferPool()
+{
+    return defaultMatAllocator;
+}
+
+/* Allocator used for the buffers allocated from now on */
+MatAllocator& GetMatAllocator()
+{
+    return *matAllocator;
+}
+
+/* Replace the allocator, NULL restores the default pool. Buffers are freed by the allocator
+ * they came from, don't destroy an allocator while its buffers are alive. */
+void SetMatAllocator(MatAllocator* const allocator)
+{
+    matAllocator = allocator ? allocator : &defaultMatAllocator;
+}
+
+/* Allocate a width x height matrix with cache line aligned rows.
+ * Contents are uninitialized except for the zeroed padding columns.
+ * If fresh is given, it's set when the buffer is new from the pool's OS pages, the
+ * padding is left to the caller then, s.t it can fault the pages in on the cores that
+ * write them (see MMHelper_FirstTouch) instead of on this thread. */
+static const Mat AllocMat(const unsigned width, const unsigned height,
+                          MatAllocator& allocator = GetMatAllocator(),
+                          int* const fresh = NULL)
+{
+    const unsigned rowSpan = RoundUpPwr2(width, 64 / sizeof(float));
+    float* __restrict const data =
+      (float*)allocator.Alloc((size_t)height * rowSpan * sizeof(float));
+
+    Mat mat{width, height, rowSpan, data};
+
+    /* a fresh buffer is only handed out as such once */
+    MatBufferPool* const pool = dynamic_cast<MatBufferPool*>(&allocator);
+    const int isFresh = pool && pool->TakeFresh(data);
+    if (fresh)
+        *fresh = isFresh;
+    if (!fresh || !isFresh)
+        ZeroMatPadding(mat);
+
+    return mat;
+}
+
+/* Deallocate matrix data, allocator has to be the one it was allocated from. That's
+ * the current one by default, code that allocates from it and frees later keeps a
+ * reference to it meanwhile (or uses Matrix), SetMatAllocator may be called between. */
+void FreeMat(Mat& mat, MatAllocator& allocator = GetMatAllocator())
+{
+    if (!mat.mat)
+        return;
+    allocator.Free(mat.mat);
+    mat.mat = NULL;
+}
+
+/*
+ * Owning matrix, frees its buffer with the allocator it was allocated from.
+ * It's movable but not copyable, so temporaries returned by value are moved (or elided)
+ * and can't be freed twice. Converts to a Mat view implicitly,
+ * so it can be passed to every function that takes a const Mat&.
+ */
+class Matrix {
+public:
+    Matrix() : m_mat{0, 0, 0, NULL}, m_allocator(NULL)
+    {
+    }
+
+    /* fresh as in AllocMat */
+    Matrix(const unsigned width, const unsigned height,
+           MatAllocator& allocator = GetMatAllocator(), int* const fresh = NULL)
+        : m_mat(AllocMat(width, height, allocator, fresh)), m_allocator(&allocator)
+    {
+    }
+
+    Matrix(Matrix&& other) noexcept : m_mat(other.m_mat), m_allocator(other.m_allocator)
+    {
+        other.m_mat.mat = NULL;
+    }
+
+    Matrix& operator=(Matrix&& other) noexcept
+    {
+        if (this != &other) {
+            Reset();
+            m_mat = other.m_mat;
+            m_allocator = other.m_allocator;
+            other.m_mat.mat = NULL;
+        }
+        return *this;
+    }
+
+    Matrix(const Matrix&) = delete;
+    Matrix& operator=(const Matrix&) = delete;
+
+    ~Matrix()
+    {
+        Reset();
+    }
+
+    /* Take the ownership of a buffer allocated by the given allocator */
+    static Matrix Adopt(const Mat& mat, MatAllocator& allocator = GetMatAllocator())
+    {
+        Matrix matrix;
+        matrix.m_mat = mat;
+        matrix.m_allocator = &allocator;
+        return matrix;
+    }
+
+    /* Give up the ownership, the caller becomes responsible for freeing the buffer */
+    const Mat Detach()
+    {
+        const Mat mat = m_mat;
+        m_mat.mat = NULL;
+        return mat;
+    }
+
+    operator const Mat&() const&
+    {
+        return m_mat;
+    }
+    /* a view of a temporary would dangle, e.g. const Mat C = MatMul(A, B); */
+    operator const Mat&() const&& = delete;
+
+    const Mat& View() const
+    {
+        return m_mat;
+    }
+
+    unsigned Width() const
+    {
+        return m_mat.width;
+    }
+
+    unsigned Height() const
+    {
+        return m_mat.height;
+    }
+
+    float* Data() const
+    {
+        return m_mat.mat;
+    }
+
+    void Reset()
+    {
+        if (m_mat.mat)
+            m_allocator->Free(m_mat.mat);
+        m_mat = {0, 0, 0, NULL};
+    }
+
+private:
+    Mat m_mat;
+    MatAllocator* m_allocator;
+};
+
+/*
+ * Non-owning view of the height x width block of mat starting at (row, col).
+ * The view keeps the rowSpan of its parent. col must be a multiple of 16
+ * to keep the rows cache line aligned, as the kernels read whole cache lines.
+ * The parent's columns right of the view act as its padding,
+ * this is harmless for A and C, as B it gets transposed or copied like any other B.
+ */
+const Mat SubMat(const Mat& mat, const unsigned row, const unsigned col,
+                 const unsigned height, const unsigned width)
+{
+    assert(col % (64 / sizeof(float)) == 0);
+    assert(row + height <= mat.height && col + width <= mat.width);
+    return {width, height, mat.rowSpan, &mat.mat[row * mat.rowSpan + col]};
+}
+
 /* Load a previously saved matrix from disk */
-const Mat LoadMat(const char* const filename)
+Matrix LoadMat(const char* const filename)
 {
     Mat mat;
     uint32_t matSize;
@@ -69,18 +676,21 @@ const Mat LoadMat(const char* const filename)
     if (!in.is_open()) {
         std::cout << "Err loading!\n";
         in.close();
-        return {0, 0, 0, NULL};
+        return Matrix();
     }
 
     in.read((char*)&mat, 3 * sizeof(uint32_t));
     in.read((char*)&matSize, sizeof(uint32_t));
     in.seekg(12 * sizeof(uint32_t), std::ios::cur);
-    mat.mat = (float*)_aligned_malloc(matSize, AVX_ALIGN);
+    mat.mat = (float*)GetMatAllocator().Alloc(matSize);
     in.read((char*)mat.mat, matSize);
 
     in.close();
 
-    return mat;
+    /* padding on the disk is not guaranteed to be zero */
+    ZeroMatPadding(mat);
+
+    return Matrix::Adopt(mat);
 }
 
 /* Dump the given matrix to the disk. */
@@ -100,37 +710,68 @@ static void DumpMat(const char* filename, const Mat& m)
     out.close();
 }
 
-/* Deallocate matrix data */
-void FreeMat(Mat& mat)
+/*
+ * The HWLocalThreadPool shared by all multithreaded multiplications, created on first use
+ * with poolCores cores and poolThreadsPerCore threads per core.
+ * Keeping it alive saves spawning and pinning every thread on each call.
+ */
+static HWLocalThreadPool& GetThreadPool()
 {
-    if (!mat.mat)
-        return;
-    _aligned_free(mat.mat);
-    mat.mat = NULL;
+    QueryCPUInfo();
+    static HWLocalThreadPool tp(poolCores, poolThreadsPerCore);
+    /* set once with tp, GetThreadPool is called from the pool's cores too */
+    static const int created = threadPoolCreated = 1;
+    (void)created;
+    return tp;
+}
+
+/*
+ * Reserve numCores cores of the default partition for a new thread pool partition,
+ * returns its index for SetMatMulPartition. Multiplications of the other partitions
+ * no longer run on these cores, e.g reserve 2 cores for small latency critical products
+ * while bulk products run on the rest.
+ */
+unsigned CreateMatMulPartition(const char* const name, const unsigned numCores)
+{
+    return GetThreadPool().AddPartition(name, numCores);
 }
-void FreeMat(const Mat& mat)
+
+/*
+ * Override the size of the thread pool, numCores physical cores with numThreadsPerCore
+ * threads each (at most maxPoolThreadsPerCore), 0 keeps the default for either. The
+ * pool is created once, so this has to be called before the first multithreaded
+ * multiplication.
+ */
+void SetThreadPoolSize(const int numCores, const int numThreadsPerCore)
 {
-    if (!mat.mat)
-        return;
-    _aligned_free(mat.mat);
+    assert(!threadPoolCreated);
+    assert(numThreadsPerCore <= maxPoolThreadsPerCore);
+    poolCoresOverride = numCores;
+    poolThreadsOverride = numThreadsPerCore;
+    if (CPUInfoQueried)
+        MMHelper_SizeThreadPool();
 }
 
-/* Round a given number to the nearest multiple of K,
-* where K is a parameter and is a power of 2 */
-static unsigned RoundUpPwr2(unsigned val, unsigned pwr2)
+/*
+ * Whether a multithreaded step on a partition should run inline on the calling thread:
+ * it's called from a job on the pool (e.g. a batch of multiplications run as parallel
+ * tasks) and the partition has a queued job per core already, so splitting it would
+ * only queue more jobs behind the others. Jobs of other partitions don't count, they
+ * don't run on its cores. Otherwise it's split as usual, a worker waiting on its own
+ * jobs runs them in WaitBatch, so nested multiplications don't deadlock either way.
+ */
+static int MMHelper_RunInline(HWLocalThreadPool& tp, const unsigned partition)
 {
-    return (val + (pwr2 - 1)) & (~(pwr2 - 1));
+    return tp.IsWorkerThread() &&
+           tp.NumQueuedJobs(partition) >= max(tp.NumCoresOfPartition(partition), 1u);
 }
 
-/* Compute the transpose of a given matrix.
+/* Compute the transpose of a given matrix into T, which is already allocated.
  * A singlethreaded implementation without block tiling. */
-__declspec(noalias) const Mat TransposeMat(const Mat& mat)
+__declspec(noalias) void TransposeMat(const Mat& mat, const Mat& T)
 {
-    const unsigned tRowSpan = RoundUpPwr2(mat.height, 64 / sizeof(float));
-    float* __restrict const tData =
-      (float*)_aligned_malloc(mat.width * tRowSpan * sizeof(float), AVX_ALIGN);
-
-    Mat T{mat.height, mat.width, tRowSpan, tData};
+    float* __restrict const tData = T.mat;
+    const unsigned tRowSpan = T.rowSpan;
 
     // the loops are truly interchangable as we encounter a cache miss either ways
     for (int rowT = 0; rowT < T.height; ++rowT) {
@@ -139,64 +780,277 @@ __declspec(noalias) const Mat TransposeMat(const Mat& mat)
         }
     }
 
-    return T;
+    /* padding of BT is multiplied with the padding of A in the kernels */
+    ZeroMatPadding(T);
 }
 
-/* Print the given matrix to given std::ostream */
-static void PrintMat(const Mat& mat, std::ostream& stream)
+/*
+ * Run func(begin, end) over [0, count) on a partition of the thread pool, in bands of
+ * bandSz that are split between the threads of the core picking them up, and wait for
+ * all of them while running bands on the calling thread too.
+ */
+template <typename F>
+static void MMHelper_ParallelBands(const unsigned count, const unsigned bandSz,
+                                   const F& func, const unsigned partition,
+                                   const int priority)
 {
-    stream << "w, h, rS: " << mat.width << " " << mat.height << "  " << mat.rowSpan
-           << "\n";
-    for (int i = 0; i < mat.height; i++) {
-        for (int j = 0; j < mat.width; ++j) {
-            stream << mat.mat[i * mat.rowSpan + j] << " ";
+    HWLocalThreadPool& tp = GetThreadPool();
+    if (MMHelper_RunInline(tp, partition)) {
+        if (count > 0)
+            func(0, count);
+        return;
+    }
+
+    HWLocalThreadPool::JobBatch batch;
+    const unsigned numThreads = tp.NumThreadsPerCore();
+
+    for (unsigned begin = 0; begin < count; begin += bandSz) {
+        const unsigned end = min(begin + bandSz, count);
+        const unsigned split = (end - begin + numThreads - 1) / numThreads;
+
+        std::vector<std::function<void()>> job;
+        for (unsigned t = 0; t < numThreads; ++t) {
+            const unsigned subBegin = min(begin + t * split, end);
+            const unsigned subEnd = min(subBegin + split, end);
+            job.push_back([=, &func]() {
+                if (subBegin < subEnd)
+                    func(subBegin, subEnd);
+            });
         }
-        stream << "\n";
+        tp.Add(job, 0, &batch, partition, priority);
     }
+
+    tp.WaitBatch(batch);
 }
 
-/**************** Naive, initial implementations ****************/
+/* How ParallelFor and ParallelReduce hand out chunks of the range to the threads */
+enum MMSchedule {
+    MM_SCHEDULE_STATIC,  /* fixed chunks, by default an even split between threads */
+    MM_SCHEDULE_DYNAMIC, /* chunks of a fixed size taken by threads as they finish */
+    MM_SCHEDULE_GUIDED   /* as dynamic, chunks shrinking with the remaining range */
+};
 
-/* Naive MatMul */
-const Mat ST_NaiveMatMul(const Mat& matA, const Mat& matB)
+/* Threads of the pool taking jobs of the given partition */
+static unsigned MMHelper_PartitionThreads(HWLocalThreadPool& tp,
+                                          const unsigned partition)
 {
-    /* First : naive solution with but with some tricks to make compiler (MSVC) behave
-     * Note that, in this case, manually unrolling the loop helps
-     * as the compiler can't auto-vectorize non-contagious memory access */
-    float* __restrict const matData =
-      (float*)_aligned_malloc(matA.height * matB.rowSpan * sizeof(float), AVX_ALIGN);
-
-    Mat matC{matB.width, matA.height, matB.rowSpan, matData};
+    return max(tp.NumCoresOfPartition(partition), 1u) * tp.NumThreadsPerCore();
+}
 
-    for (int rowC = 0; rowC < matA.height; ++rowC) {
-        for (int colC = 0; colC < matB.width; ++colC) {
-            /* an independent, local accumulator. */
-            float accumulate = 0;
-            int pos = 0;
-            /* manual unrolling IS helpful in this case */
-            for (; pos < matA.width - 4; pos += 4) {
-                accumulate += matA.mat[rowC * matA.rowSpan + pos] *
-                                matB.mat[pos * matB.rowSpan + colC] +
-                              matA.mat[rowC * matA.rowSpan + pos + 1] *
-                                matB.mat[(pos + 1) * matB.rowSpan + colC] +
-                              matA.mat[rowC * matA.rowSpan + pos + 2] *
-                                matB.mat[(pos + 2) * matB.rowSpan + colC] +
-                              matA.mat[rowC * matA.rowSpan + pos + 3] *
-                                matB.mat[(pos + 3) * matB.rowSpan + colC];
-            }
-            for (; pos < matA.width; ++pos) {
-                accumulate += matA.mat[rowC * matA.rowSpan + pos] *
-                              matB.mat[pos * matB.rowSpan + colC];
-            }
-            matData[rowC * matB.rowSpan + colC] = accumulate;
-        }
+/*
+ * Run func(chunkBegin, chunkEnd) over chunks covering [begin, end) on the thread pool,
+ * scheduled as given, and wait for them while running chunks on the calling thread too.
+ * chunk is the chunk size, the minimum one for guided, 0 picks one: an even split for
+ * static, a few chunks per thread otherwise. A range of at most one chunk runs on the
+ * calling thread, so callers pass a chunk worth the overhead of a job.
+ */
+template <typename F>
+void ParallelFor(const unsigned begin, const unsigned end, const F& func,
+                 const MMSchedule schedule = MM_SCHEDULE_STATIC, unsigned chunk = 0,
+                 const unsigned partition = mmPartition,
+                 const int priority = mmPriority)
+{
+    if (begin >= end)
+        return;
+    const unsigned count = end - begin;
+    HWLocalThreadPool& tp = GetThreadPool();
+    const unsigned numThreads = MMHelper_PartitionThreads(tp, partition);
+    if (chunk == 0) {
+        chunk = schedule == MM_SCHEDULE_STATIC ? (count + numThreads - 1) / numThreads
+                                               : max(count / (numThreads * 8), 1u);
+    }
+    if (count <= chunk || MMHelper_RunInline(tp, partition)) {
+        func(begin, end);
+        return;
+    }
+
+    if (schedule == MM_SCHEDULE_STATIC) {
+        /* a band of chunks per core, a chunk per thread */
+        MMHelper_ParallelBands(
+          count, chunk * tp.NumThreadsPerCore(),
+          [&](const unsigned b, const unsigned e) { func(begin + b, begin + e); },
+          partition, priority);
+        return;
+    }
+
+    /* every thread takes chunks off the shared counter until the range is done */
+    std::atomic<unsigned> next(0);
+    auto worker = [&]() {
+        unsigned b = next.load(std::memory_order_relaxed), size;
+        do {
+            if (b >= count)
+                return;
+            size = schedule == MM_SCHEDULE_GUIDED
+                     ? max((count - b) / (2 * numThreads), chunk)
+                     : chunk;
+            if (!next.compare_exchange_weak(b, b + size))
+                continue;
+            func(begin + b, begin + min(b + size, count));
+            b = next.load(std::memory_order_relaxed);
+        } while (1);
+    };
+
+    HWLocalThreadPool::JobBatch batch;
+    const unsigned numJobs = min(numThreads / tp.NumThreadsPerCore(),
+                                 (count + chunk - 1) / chunk);
+    for (unsigned i = 0; i < numJobs; ++i) {
+        /* spread over the core groups, each core's threads share the counter */
+        tp.Add(std::vector<std::function<void()>>(tp.NumThreadsPerCore(), worker), i,
+               &batch, partition, priority);
+    }
+    tp.WaitBatch(batch);
+}
+
+/* Chunks ParallelReduce splits a range into unless it's given a chunk size */
+constexpr unsigned mmReduceChunks = 64;
+
+/*
+ * Reduce over [begin, end): func(chunkBegin, chunkEnd) returns the value of a chunk,
+ * they're combined with reduce(a, b) starting from identity, in range order. The
+ * chunks are of size chunk, or mmReduceChunks of them if it's 0, whatever the pool
+ * looks like, schedule only decides which threads take them. So the result is the
+ * same on every run with any schedule, even for float sums, also when the range runs
+ * inline on the calling thread.
+ */
+template <typename T, typename F, typename R>
+T ParallelReduce(const unsigned begin, const unsigned end, const T& identity,
+                 const F& func, const R& reduce,
+                 const MMSchedule schedule = MM_SCHEDULE_STATIC, unsigned chunk = 0,
+                 const unsigned partition = mmPartition,
+                 const int priority = mmPriority)
+{
+    if (begin >= end)
+        return identity;
+    const unsigned count = end - begin;
+    if (chunk == 0)
+        chunk = (count + mmReduceChunks - 1) / mmReduceChunks;
+    const unsigned numChunks = (count - 1) / chunk + 1;
+
+    /* the pool runs ranges of chunk indices, every chunk keeps its own value */
+    std::vector<T> partials(numChunks, identity);
+    ParallelFor(0, numChunks, [&](const unsigned first, const unsigned last) {
+        for (unsigned c = first; c < last; ++c) {
+            const unsigned b = begin + c * chunk;
+            partials[c] = func(b, b + min(chunk, end - b));
+        }
+    }, schedule, 0, partition, priority);
+
+    T result = identity;
+    for (auto& partial : partials) {
+        result = reduce(result, partial);
+    }
+    return result;
+}
+
+/* Deep copy of the given matrix, into a buffer with zeroed padding. */
+static const Mat CopyMat(const Mat& mat, MatAllocator& allocator = GetMatAllocator())
+{
+    const Mat copy = AllocMat(mat.width, mat.height, allocator);
+    /* chunks of about 256KB of rows, a small matrix is copied on the calling thread */
+    ParallelFor(0, mat.height, [&](const unsigned begin, const unsigned end) {
+        for (int row = begin; row < end; ++row) {
+            memcpy(&copy.mat[row * copy.rowSpan], &mat.mat[row * mat.rowSpan],
+                   mat.width * sizeof(float));
+        }
+    }, MM_SCHEDULE_DYNAMIC, max(65536u / copy.rowSpan, 1u));
+    return copy;
+}
+
+/*
+ * Multithreaded transpose into T, which is already allocated. Each thread writes its own
+ * band of T rows, so the page faults of a fresh T are taken in parallel too.
+ * Inside a band, rows of mat are read contiguously and T is written 64 rows at a time.
+ */
+__declspec(noalias) void MTTransposeMat(const Mat& mat, const Mat& T,
+                                        const unsigned partition = mmPartition,
+                                        const int priority = mmPriority)
+{
+    float* __restrict const tData = T.mat;
+    const unsigned tRowSpan = T.rowSpan;
+
+    MMHelper_ParallelBands(T.height, 128, [&](const unsigned begin, const unsigned end) {
+        for (int colT = 0; colT < T.width; ++colT) {
+            for (int rowT = begin; rowT < end; ++rowT) {
+                tData[rowT * tRowSpan + colT] = mat.mat[colT * mat.rowSpan + rowT];
+            }
+        }
+        /* padding of BT is multiplied with the padding of A in the kernels */
+        for (int rowT = begin; rowT < end; ++rowT) {
+            memset(&tData[rowT * tRowSpan + T.width], 0,
+                   (tRowSpan - T.width) * sizeof(float));
+        }
+    }, partition, priority);
+}
+
+/* Compute the transpose of a given matrix. */
+__declspec(noalias) const Mat TransposeMat(const Mat& mat,
+                                           MatAllocator& allocator = GetMatAllocator())
+{
+    const unsigned tRowSpan = RoundUpPwr2(mat.height, 64 / sizeof(float));
+    float* __restrict const tData =
+      (float*)allocator.Alloc(mat.width * tRowSpan * sizeof(float));
+
+    Mat T{mat.height, mat.width, tRowSpan, tData};
+
+    TransposeMat(mat, T);
+
+    return T;
+}
+
+/* Print the given matrix to given std::ostream */
+static void PrintMat(const Mat& mat, std::ostream& stream)
+{
+    stream << "w, h, rS: " << mat.width << " " << mat.height << "  " << mat.rowSpan
+           << "\n";
+    for (int i = 0; i < mat.height; i++) {
+        for (int j = 0; j < mat.width; ++j) {
+            stream << mat.mat[i * mat.rowSpan + j] << " ";
+        }
+        stream << "\n";
+    }
+}
+
+/**************** Naive, initial implementations ****************/
+
+/* Naive MatMul */
+const Mat ST_NaiveMatMul(const Mat& matA, const Mat& matB)
+{
+    /* First : naive solution with but with some tricks to make compiler (MSVC) behave
+     * Note that, in this case, manually unrolling the loop helps
+     * as the compiler can't auto-vectorize non-contagious memory access */
+    const Mat matC = AllocMat(matB.width, matA.height);
+    float* __restrict const matData = matC.mat;
+
+    for (int rowC = 0; rowC < matA.height; ++rowC) {
+        for (int colC = 0; colC < matB.width; ++colC) {
+            /* an independent, local accumulator. */
+            float accumulate = 0;
+            int pos = 0;
+            /* manual unrolling IS helpful in this case */
+            for (; pos < matA.width - 4; pos += 4) {
+                accumulate += matA.mat[rowC * matA.rowSpan + pos] *
+                                matB.mat[pos * matB.rowSpan + colC] +
+                              matA.mat[rowC * matA.rowSpan + pos + 1] *
+                                matB.mat[(pos + 1) * matB.rowSpan + colC] +
+                              matA.mat[rowC * matA.rowSpan + pos + 2] *
+                                matB.mat[(pos + 2) * matB.rowSpan + colC] +
+                              matA.mat[rowC * matA.rowSpan + pos + 3] *
+                                matB.mat[(pos + 3) * matB.rowSpan + colC];
+            }
+            for (; pos < matA.width; ++pos) {
+                accumulate += matA.mat[rowC * matA.rowSpan + pos] *
+                              matB.mat[pos * matB.rowSpan + colC];
+            }
+            matData[rowC * matC.rowSpan + colC] = accumulate;
+        }
     }
 
     return matC;
 }
 
-/* MatMul with transposed B for improved cache behavior. */
-const Mat ST_TransposedBMatMul(const Mat& matA, const Mat& matB)
+/* MatMul with an already transposed B, writes (or adds if addToC is set) into matC. */
+void ST_TransposedBMatMulBT(const Mat& matA, const Mat& matBT, const Mat& matC,
+                            const int addToC)
 {
     /* 
      * Now, transposing B and then traversing it row order seemed promising!
@@ -204,24 +1058,37 @@ const Mat ST_TransposedBMatMul(const Mat& matA, const Mat& matB)
      * compiler wouldn't vectorize the loop, 
      * so we keep it simple and let MSVC auto vectorize this.
      */
-    float* __restrict const matData =
-      (float*)_aligned_malloc(matA.height * matB.rowSpan * sizeof(float), AVX_ALIGN);
+    float* __restrict const matData = matC.mat;
 
-    Mat matC{matB.width, matA.height, matB.rowSpan, matData};
-
-    const Mat matBT = TransposeMat(matB);
     for (int rowC = 0; rowC < matA.height; ++rowC) {
-        for (int colC = 0; colC < matB.width; ++colC) {
-            float accumulate = 0;
+        for (int colC = 0; colC < matBT.height; ++colC) {
+            float accumulate = addToC ? matData[rowC * matC.rowSpan + colC] : 0;
             for (int pos = 0; pos < matA.width; ++pos) {
                 accumulate += matA.mat[rowC * matA.rowSpan + pos] *
                               matBT.mat[colC * matBT.rowSpan + pos];
             }
-            matData[rowC * matB.rowSpan + colC] = accumulate;
+            matData[rowC * matC.rowSpan + colC] = accumulate;
         }
     }
+}
+
+/* MatMul with transposed B for improved cache behavior, writes into the given matC. */
+void ST_TransposedBMatMul(const Mat& matA, const Mat& matB, const Mat& matC)
+{
+    MatAllocator& allocator = GetMatAllocator();
+    const Mat matBT = TransposeMat(matB, allocator);
+
+    ST_TransposedBMatMulBT(matA, matBT, matC, 0);
+
+    allocator.Free(matBT.mat);
+}
+
+/* MatMul with transposed B for improved cache behavior. */
+const Mat ST_TransposedBMatMul(const Mat& matA, const Mat& matB)
+{
+    const Mat matC = AllocMat(matB.width, matA.height);
 
-    _aligned_free(matBT.mat);
+    ST_TransposedBMatMul(matA, matB, matC);
 
     return matC;
 }
@@ -246,14 +1113,13 @@ const Mat ST_BlockMult(const Mat& matA, const Mat& matB)
     *
     * Also, I had to assign offsets to temporary constants,
     * because otherwise MSVC can't auto-vectorize. */
-    float* __restrict const matData =
-      (float*)_aligned_malloc(matA.height * matB.rowSpan * sizeof(float), AVX_ALIGN);
-
-    Mat matC{matB.width, matA.height, matB.rowSpan, matData};
+    MatAllocator& allocator = GetMatAllocator();
+    const Mat matC = AllocMat(matB.width, matA.height, allocator);
+    float* __restrict const matData = matC.mat;
 
     const unsigned blockX = 16, blockY = 16;
 
-    const Mat matBT = TransposeMat(matB);
+    const Mat matBT = TransposeMat(matB, allocator);
 
     int rowC = 0;
     for (; rowC < matA.height - blockY; rowC += blockY) {
@@ -271,7 +1137,7 @@ const Mat ST_BlockMult(const Mat& matA, const Mat& matB)
                         accumulate +=
                           matA.mat[matAoffset + pos] * matBT.mat[matBoffset + pos];
                     }
-                    matData[r * matB.rowSpan + c] = accumulate;
+                    matData[r * matC.rowSpan + c] = accumulate;
                 }
             }
         }
@@ -285,7 +1151,7 @@ const Mat ST_BlockMult(const Mat& matA, const Mat& matB)
                     accumulate +=
                       matA.mat[matAoffset + pos] * matBT.mat[matBoffset + pos];
                 }
-                matData[r * matB.rowSpan + c] = accumulate;
+                matData[r * matC.rowSpan + c] = accumulate;
             }
         }
     }
@@ -297,11 +1163,11 @@ const Mat ST_BlockMult(const Mat& matA, const Mat& matB)
             for (int pos = 0; pos < matA.width; ++pos) {
                 accumulate += matA.mat[matAoffset + pos] * matBT.mat[matBoffset + pos];
             }
-            matData[rowC * matB.rowSpan + colC] = accumulate;
+            matData[rowC * matC.rowSpan + colC] = accumulate;
         }
     }
 
-    _aligned_free(matBT.mat);
+    allocator.Free(matBT.mat);
 
     return matC;
 }
@@ -315,40 +1181,77 @@ __declspec(noalias) void MMHelper_MultAnyBlocks(float* __restrict const matData,
                                                 const Mat& matBT, const unsigned colC,
                                                 const unsigned rowC, const int blockX,
                                                 const int blockY,
-                                                const MMBlockInfo& mmBlockInfo);
-
-__declspec(noalias) void MMHelper_MultL2Blocks(float* __restrict const matData,
-                                               const unsigned rowSpan, const Mat& matA,
+                                                const MMBlockInfo& mmBlockInfo,
+                                                const int addToC);
+
+/* A full block of C being streamed, see MMHelper_MultFullBlocks */
+typedef struct MMStreamBlock {
+    /* the block in C, its top left corner at (colC, rowC) */
+    float* c;
+    unsigned cSpan, colC, rowC, width, height;
+    /* the lines of the block shared between its L2 blocks are gathered here */
+    float* tile;
+    unsigned tileSpan;
+} MMStreamBlock;
+
+__declspec(noalias) void MMHelper_MultL2Blocks(float* __restrict const dst,
+                                               const unsigned dstSpan, const Mat& matA,
                                                const Mat& matBT, const unsigned col,
                                                const unsigned row,
                                                const unsigned L2BlockX,
-                                               const unsigned L2BlockY);
+                                               const unsigned L2BlockY, const int addToC,
+                                               const unsigned nextCol,
+                                               const unsigned nextRow,
+                                               const MMStreamBlock* const stream =
+                                                 NULL);
 
 __declspec(noalias) void MMHelper_MultFullBlocks(float* __restrict const matData,
                                                  const unsigned rowSpan,
                                                  const Mat& matA, const Mat& matBT,
                                                  const unsigned colC,
                                                  const unsigned rowC,
-                                                 const MMBlockInfo& mmBlockInfo);
+                                                 const MMBlockInfo& mmBlockInfo,
+                                                 const int addToC, const int streamC,
+                                                 std::atomic<unsigned>* const progress);
 
-/* Declarations for helper functions that handle NxM blocks */
+/* Declarations for helper functions that handle NxM blocks.
+ * The block of C at (row, col) is written to dst, its rows dstSpan floats apart. */
 
-__declspec(noalias) void MMHelper_Mult4x3Blocks(float* __restrict const matData,
-                                                const unsigned rowSpan, const Mat& matA,
+__declspec(noalias) void MMHelper_Mult4x3Blocks(float* __restrict const dst,
+                                                const unsigned dstSpan, const Mat& matA,
                                                 const Mat& matBT, const unsigned col,
-                                                const unsigned row);
-__declspec(noalias) void MMHelper_Mult4x1Blocks(float* __restrict const matData,
-                                                const unsigned rowSpan, const Mat& matA,
+                                                const unsigned row,
+                                                const int addToC);
+__declspec(noalias) void MMHelper_Mult4x1Blocks(float* __restrict const dst,
+                                                const unsigned dstSpan, const Mat& matA,
                                                 const Mat& matBT, const unsigned col,
-                                                const unsigned row);
-__declspec(noalias) void MMHelper_Mult1x3Blocks(float* __restrict const matData,
-                                                const unsigned rowSpan, const Mat& matA,
+                                                const unsigned row,
+                                                const int addToC);
+__declspec(noalias) void MMHelper_Mult1x3Blocks(float* __restrict const dst,
+                                                const unsigned dstSpan, const Mat& matA,
                                                 const Mat& matBT, const unsigned col,
-                                                const unsigned row);
-__declspec(noalias) void MMHelper_Mult1x1Blocks(float* __restrict const matData,
-                                                const unsigned rowSpan, const Mat& matA,
+                                                const unsigned row,
+                                                const int addToC);
+__declspec(noalias) void MMHelper_Mult1x1Blocks(float* __restrict const dst,
+                                                const unsigned dstSpan, const Mat& matA,
                                                 const Mat& matBT, const unsigned col,
-                                                const unsigned row);
+                                                const unsigned row,
+                                                const int addToC);
+
+/*
+ * Horizontal sums of 4 vectors, reduced in registers with a hadd network:
+ * returns {sum(v1), sum(v2), sum(v3), sum(v4)}.
+ */
+inline __m128 MMHelper_HSum4(const __m256 v1, const __m256 v2, const __m256 v3,
+                             const __m256 v4)
+{
+    /* per 128 bit lane: [v1 v1 v2 v2], [v3 v3 v4 v4] pairwise sums */
+    const __m256 s12 = _mm256_hadd_ps(v1, v2);
+    const __m256 s34 = _mm256_hadd_ps(v3, v4);
+    /* per 128 bit lane: [v1 v2 v3 v4], add the two lanes */
+    const __m256 s1234 = _mm256_hadd_ps(s12, s34);
+    return _mm_add_ps(_mm256_castps256_ps128(s1234), _mm256_extractf128_ps(s1234, 1));
+}
 
 /* 
  * Helper function for computing a block out of the output matrix C.
@@ -361,7 +1264,8 @@ __declspec(noalias) void MMHelper_MultAnyBlocks(float* __restrict const matData,
                                                 const Mat& matBT, const unsigned colC,
                                                 const unsigned rowC, const int blockX,
                                                 const int blockY,
-                                                const MMBlockInfo& mmBlockInfo)
+                                                const MMBlockInfo& mmBlockInfo,
+                                                const int addToC)
 {
     /* if no work to be done, exit */
     if (blockX <= 0 || blockY <= 0)
@@ -377,21 +1281,23 @@ __declspec(noalias) void MMHelper_MultAnyBlocks(float* __restrict const matData,
         int blockColC = colC;
         /* handle (L2X x L2Y) blocks */
         for (; blockColC <= colC + blockX - L2BlockX; blockColC += L2BlockX) {
-            MMHelper_MultL2Blocks(matData, rowSpan, matA, matBT, blockColC, blockRowC,
-                                  L2BlockX, L2BlockY);
+            MMHelper_MultL2Blocks(&matData[blockRowC * rowSpan + blockColC], rowSpan, matA,
+                                  matBT, blockColC, blockRowC, L2BlockX, L2BlockY,
+                                  addToC, blockColC, blockRowC);
         }
         /* handle the remaining columns, (w<L2X, h=L2Y) */
         for (int blockRow = blockRowC; blockRow < blockRowC + L2BlockY; blockRow += 4) {
             int blockCol = blockColC;
             if ((colC + blockX - blockColC) > 4) {
                 for (; blockCol <= colC + blockX - 3; blockCol += 3) {
-                    MMHelper_Mult4x3Blocks(matData, rowSpan, matA, matBT, blockCol,
-                                           blockRow);
+                    MMHelper_Mult4x3Blocks(&matData[blockRow * rowSpan + blockCol],
+                                           rowSpan, matA, matBT, blockCol, blockRow,
+                                           addToC);
                 }
             }
             for (; blockCol < colC + blockX; ++blockCol) {
-                MMHelper_Mult4x1Blocks(matData, rowSpan, matA, matBT, blockCol,
-                                       blockRow);
+                MMHelper_Mult4x1Blocks(&matData[blockRow * rowSpan + blockCol], rowSpan,
+                                       matA, matBT, blockCol, blockRow, addToC);
             }
         }
     }
@@ -401,13 +1307,15 @@ __declspec(noalias) void MMHelper_MultAnyBlocks(float* __restrict const matData,
         /* handle (L2X x h<L2Y), h%4==0 blocks */
         for (; blockColC <= colC + blockX - L2BlockX; blockColC += L2BlockX) {
             for (int blockCol = 0; blockCol < L2BlockX; blockCol += 3) {
-                MMHelper_Mult4x3Blocks(matData, rowSpan, matA, matBT,
-                                       blockColC + blockCol, blockRowC);
+                MMHelper_Mult4x3Blocks(&matData[blockRowC * rowSpan + blockColC + blockCol],
+                                       rowSpan, matA, matBT, blockColC + blockCol,
+                                       blockRowC, addToC);
             }
         }
         /* handle remanining columns (w<L2X x h<L2Y), h%4==0 */
         for (; blockColC < colC + blockX; ++blockColC) {
-            MMHelper_Mult4x1Blocks(matData, rowSpan, matA, matBT, blockColC, blockRowC);
+            MMHelper_Mult4x1Blocks(&matData[blockRowC * rowSpan + blockColC], rowSpan,
+                                   matA, matBT, blockColC, blockRowC, addToC);
         }
     }
     /* handle the very last row, h < 4 */
@@ -416,22 +1324,25 @@ __declspec(noalias) void MMHelper_MultAnyBlocks(float* __restrict const matData,
         /* handle (L2X x h<3) blocks */
         for (; blockColC <= colC + blockX - L2BlockX; blockColC += L2BlockX) {
             for (int blockCol = 0; blockCol < L2BlockX; blockCol += 3) {
-                MMHelper_Mult1x3Blocks(matData, rowSpan, matA, matBT,
-                                       blockColC + blockCol, blockRowC);
+                MMHelper_Mult1x3Blocks(&matData[blockRowC * rowSpan + blockColC + blockCol],
+                                       rowSpan, matA, matBT, blockColC + blockCol,
+                                       blockRowC, addToC);
             }
         }
         /* handle remanining columns (w<L2X x h<3) */
         for (; blockColC < colC + blockX; ++blockColC) {
-            MMHelper_Mult1x1Blocks(matData, rowSpan, matA, matBT, blockColC, blockRowC);
+            MMHelper_Mult1x1Blocks(&matData[blockRowC * rowSpan + blockColC], rowSpan,
+                                   matA, matBT, blockColC, blockRowC, addToC);
         }
     }
 }
 
 /* Calculates the dot product corresponding to a single entry in matrix C. */
-__declspec(noalias) void MMHelper_Mult1x1Blocks(float* __restrict const matData,
-                                                const unsigned rowSpan, const Mat& matA,
+__declspec(noalias) void MMHelper_Mult1x1Blocks(float* __restrict const dst,
+                                                const unsigned dstSpan, const Mat& matA,
                                                 const Mat& matBT, const unsigned col,
-                                                const unsigned row)
+                                                const unsigned row,
+                                                const int addToC)
 {
     /* scalar accumulator */
     __declspec(align(32)) float fps[8];
@@ -465,26 +1376,23 @@ __declspec(noalias) void MMHelper_Mult1x1Blocks(float* __restrict const matData,
     c1 = _mm256_add_ps(c1, c2);
     _mm256_store_ps(&fps[0], c1);
 
-    accumulate = 0;
+    /* start from the existing value of C if the product is accumulated onto it */
+    accumulate = addToC ? dst[0] : 0;
     for (int i = 0; i < 8; ++i) {
         accumulate += fps[i];
     }
 
     /* store */
-    matData[row * rowSpan + col] = accumulate;
+    dst[0] = accumulate;
 }
 
 /* Calculates a 1x3 block on the matrix C, (t,l,b,r)->(row,col,row+1,col+3) */
-__declspec(noalias) void MMHelper_Mult1x3Blocks(float* __restrict const matData,
-                                                const unsigned rowSpan, const Mat& matA,
+__declspec(noalias) void MMHelper_Mult1x3Blocks(float* __restrict const dst,
+                                                const unsigned dstSpan, const Mat& matA,
                                                 const Mat& matBT, const unsigned col,
-                                                const unsigned row)
+                                                const unsigned row,
+                                                const int addToC)
 {
-    /* set up scalar array and accumulators for doing the horizontal sum (__m256 -> f32)
-     * and storing its value. Horizontal sum is auto-vectorized by the compiler anyways. */
-    __declspec(align(32)) float fps[8 * 3];
-    __declspec(align(32)) float accumulate[3];
-
     /* we will be reusing these */
     const unsigned matAoffset = row * matA.rowSpan;
     const unsigned matBToffset1 = (col + 0) * matBT.rowSpan,
@@ -509,37 +1417,26 @@ __declspec(noalias) void MMHelper_Mult1x3Blocks(float* __restrict const matData,
         c3 = _mm256_fmadd_ps(a1, b3, c3);
     }
 
-    /* horizontal sum */
-
-    memset(&accumulate[0], 0, 3 * sizeof(float));
-
-    _mm256_store_ps(&fps[0], c1);
-    _mm256_store_ps(&fps[8], c2);
-    _mm256_store_ps(&fps[16], c3);
-
-    /* autovectorized */
-    for (int i = 0; i < 3; ++i) {
-        for (int j = 0; j < 8; ++j) {
-            accumulate[i] += fps[i * 8 + j];
-        }
+    /* horizontal sum in registers, on top of C if accumulating */
+    __m128 sums = MMHelper_HSum4(c1, c2, c3, _mm256_setzero_ps());
+    const __m128i rowMask = _mm_set_epi32(0, -1, -1, -1);
+    if (addToC) {
+        sums = _mm_add_ps(sums, _mm_maskload_ps(&dst[0], rowMask));
     }
 
-    /* stores */
-    matData[row * rowSpan + col + 0] = accumulate[0];
-    matData[row * rowSpan + col + 1] = accumulate[1];
-    matData[row * rowSpan + col + 2] = accumulate[2];
+    /* store */
+    _mm_maskstore_ps(&dst[0], rowMask, sums);
 }
 
 /* Calculates a 4x1 block on output matrix C. (t,l,b,r)->(row,col,row+4,col+1) */
-__declspec(noalias) void MMHelper_Mult4x1Blocks(float* __restrict const matData,
-                                                const unsigned rowSpan, const Mat& matA,
+__declspec(noalias) void MMHelper_Mult4x1Blocks(float* __restrict const dst,
+                                                const unsigned dstSpan, const Mat& matA,
                                                 const Mat& matBT, const unsigned col,
-                                                const unsigned row)
+                                                const unsigned row,
+                                                const int addToC)
 {
-    /* set up scalar array and accumulators for doing the horizontal sum (__m256 -> f32)
-    * and storing its value. Horizontal sum is auto-vectorized by the compiler anyways. */
-    __declspec(align(32)) float fps[8 * 12];
-    __declspec(align(32)) float accumulate[8 * 12];
+    /* placeholder for the sums, the column of C can't be written as a vector */
+    __declspec(align(16)) float accumulate[4];
 
     const unsigned matAoffset1 = (row + 0) * matA.rowSpan,
                    matAoffset2 = (row + 1) * matA.rowSpan,
@@ -586,44 +1483,33 @@ __declspec(noalias) void MMHelper_Mult4x1Blocks(float* __restrict const matData,
         c8 = _mm256_fmadd_ps(a42, b2, c8);
     }
 
-    /* horizontal sum */
-
-    memset(&accumulate[0], 0, 4 * sizeof(float));
-
     c1 = _mm256_add_ps(c1, c5);
     c2 = _mm256_add_ps(c2, c6);
     c3 = _mm256_add_ps(c3, c7);
     c4 = _mm256_add_ps(c4, c8);
 
-    _mm256_store_ps(&fps[0], c1);
-    _mm256_store_ps(&fps[8], c2);
-    _mm256_store_ps(&fps[16], c3);
-    _mm256_store_ps(&fps[24], c4);
-
-    /* autovectorized */
-    for (int i = 0; i < 4; ++i) {
-        for (int j = 0; j < 8; ++j) {
-            accumulate[i] += fps[i * 8 + j];
-        }
+    /* horizontal sum in registers, on top of C if accumulating */
+    __m128 sums = MMHelper_HSum4(c1, c2, c3, c4);
+    if (addToC) {
+        sums = _mm_add_ps(sums, _mm_set_ps(dst[3 * dstSpan], dst[2 * dstSpan],
+                                           dst[1 * dstSpan], dst[0 * dstSpan]));
     }
+    _mm_store_ps(&accumulate[0], sums);
 
     /* stores */
-    matData[(row + 0) * rowSpan + col] = accumulate[0];
-    matData[(row + 1) * rowSpan + col] = accumulate[1];
-    matData[(row + 2) * rowSpan + col] = accumulate[2];
-    matData[(row + 3) * rowSpan + col] = accumulate[3];
+    dst[0 * dstSpan + 0] = accumulate[0];
+    dst[1 * dstSpan + 0] = accumulate[1];
+    dst[2 * dstSpan + 0] = accumulate[2];
+    dst[3 * dstSpan + 0] = accumulate[3];
 }
 
 /* Calculates a 4x3 block on output matrix C. (t,l,b,r)->(row,col,row+4,col+3) */
-__declspec(noalias) void MMHelper_Mult4x3Blocks(float* __restrict const matData,
-                                                const unsigned rowSpan, const Mat& matA,
+__declspec(noalias) void MMHelper_Mult4x3Blocks(float* __restrict const dst,
+                                                const unsigned dstSpan, const Mat& matA,
                                                 const Mat& matBT, const unsigned col,
-                                                const unsigned row)
+                                                const unsigned row,
+                                                const int addToC)
 {
-    /* aligned placeholders and accumulators */
-    __declspec(align(32)) float fps[8 * 12];
-    __declspec(align(32)) float accumulate[12];
-
     const unsigned matAoffset1 = (row + 0) * matA.rowSpan,
                    matAoffset2 = (row + 1) * matA.rowSpan,
                    matAoffset3 = (row + 2) * matA.rowSpan,
@@ -679,353 +1565,1716 @@ __declspec(noalias) void MMHelper_Mult4x3Blocks(float* __restrict const matData,
         _mm_prefetch((const char*)&matBT.mat[matBToffset3], _MM_HINT_T0);
     }
 
-    /* do the dot products */
-    for (int pos = 0; pos < matA.width; pos += 8) {
-        if constexpr (doL12Prefetch) {
-            if ((pos & (unsigned)15)) {
-                _mm_prefetch((const char*)&matA.mat[matAoffset1 + pos + 8],
-                             _MM_HINT_T0);
-            }
+    /* do the dot products */
+    for (int pos = 0; pos < matA.width; pos += 8) {
+        if constexpr (doL12Prefetch) {
+            if ((pos & (unsigned)15)) {
+                _mm_prefetch((const char*)&matA.mat[matAoffset1 + pos + 8],
+                             _MM_HINT_T0);
+            }
+        }
+
+        b1 = _mm256_load_ps(&matBT.mat[matBToffset1 + pos]);
+        b2 = _mm256_load_ps(&matBT.mat[matBToffset2 + pos]);
+        b3 = _mm256_load_ps(&matBT.mat[matBToffset3 + pos]);
+
+        if constexpr (doL12Prefetch) {
+            if ((pos & (unsigned)15)) {
+                _mm_prefetch((const char*)&matA.mat[matAoffset2 + pos + 8],
+                             _MM_HINT_T0);
+            }
+        }
+
+        a = _mm256_load_ps(&matA.mat[matAoffset1 + pos]);
+        c1 = _mm256_fmadd_ps(a, b1, c1);
+        c2 = _mm256_fmadd_ps(a, b2, c2);
+        c3 = _mm256_fmadd_ps(a, b3, c3);
+
+        if constexpr (doL12Prefetch) {
+            if ((pos & (unsigned)15)) {
+                _mm_prefetch((const char*)&matA.mat[matAoffset3 + pos + 8],
+                             _MM_HINT_T0);
+            }
+        }
+        a = _mm256_load_ps(&matA.mat[matAoffset2 + pos]);
+        c4 = _mm256_fmadd_ps(a, b1, c4);
+        c5 = _mm256_fmadd_ps(a, b2, c5);
+        c6 = _mm256_fmadd_ps(a, b3, c6);
+
+        if constexpr (doL12Prefetch) {
+            if ((pos & (unsigned)15)) {
+                _mm_prefetch((const char*)&matA.mat[matAoffset4 + pos + 8],
+                             _MM_HINT_T0);
+            }
+        }
+
+        a = _mm256_load_ps(&matA.mat[matAoffset3 + pos]);
+        c7 = _mm256_fmadd_ps(a, b1, c7);
+        c8 = _mm256_fmadd_ps(a, b2, c8);
+        c9 = _mm256_fmadd_ps(a, b3, c9);
+
+        if constexpr (doL12Prefetch) {
+            if ((pos & (unsigned)15)) {
+                _mm_prefetch((const char*)&matBT.mat[matBToffset1 + pos + 8],
+                             _MM_HINT_T0);
+                _mm_prefetch((const char*)&matBT.mat[matBToffset2 + pos + 8],
+                             _MM_HINT_T0);
+                _mm_prefetch((const char*)&matBT.mat[matBToffset3 + pos + 8],
+                             _MM_HINT_T0);
+            }
+        }
+
+        a = _mm256_load_ps(&matA.mat[matAoffset4 + pos]);
+        c10 = _mm256_fmadd_ps(a, b1, c10);
+        c11 = _mm256_fmadd_ps(a, b2, c11);
+        c12 = _mm256_fmadd_ps(a, b3, c12);
+    }
+
+    /* horizontal sums in registers, sums1:3 hold the 12 entries in row major order */
+    const __m128 sums1 = MMHelper_HSum4(c1, c2, c3, c4);
+    const __m128 sums2 = MMHelper_HSum4(c5, c6, c7, c8);
+    const __m128 sums3 = MMHelper_HSum4(c9, c10, c11, c12);
+
+    /* split them into rows of 3, the 4th lane is masked out */
+    __m128 row1 = sums1;
+    __m128 row2 = _mm_castsi128_ps(
+      _mm_alignr_epi8(_mm_castps_si128(sums2), _mm_castps_si128(sums1), 12));
+    __m128 row3 = _mm_castsi128_ps(
+      _mm_alignr_epi8(_mm_castps_si128(sums3), _mm_castps_si128(sums2), 8));
+    __m128 row4 = _mm_castsi128_ps(_mm_srli_si128(_mm_castps_si128(sums3), 4));
+
+    /* on top of the existing values of C if accumulating */
+    const __m128i rowMask = _mm_set_epi32(0, -1, -1, -1);
+    if (addToC) {
+        row1 = _mm_add_ps(row1, _mm_maskload_ps(&dst[0 * dstSpan], rowMask));
+        row2 = _mm_add_ps(row2, _mm_maskload_ps(&dst[1 * dstSpan], rowMask));
+        row3 = _mm_add_ps(row3, _mm_maskload_ps(&dst[2 * dstSpan], rowMask));
+        row4 = _mm_add_ps(row4, _mm_maskload_ps(&dst[3 * dstSpan], rowMask));
+    }
+
+    /* stores */
+    _mm_maskstore_ps(&dst[0 * dstSpan], rowMask, row1);
+    _mm_maskstore_ps(&dst[1 * dstSpan], rowMask, row2);
+    _mm_maskstore_ps(&dst[2 * dstSpan], rowMask, row3);
+    _mm_maskstore_ps(&dst[3 * dstSpan], rowMask, row4);
+}
+
+/* Prefetch lines [begin, end) of an L2 block into L2, A rows first, then B^T rows.
+ * Either set of rows can be skipped, when it's already shared with the previous block. */
+__declspec(noalias) void MMHelper_PrefetchL2Block(const Mat& matA, const Mat& matBT,
+                                                  const unsigned col, const unsigned row,
+                                                  const unsigned linesA,
+                                                  const unsigned begin, const unsigned end)
+{
+    const unsigned lineFloats = cacheLineSz / sizeof(float);
+    const unsigned rowLines = (matA.width + lineFloats - 1) / lineFloats;
+
+    for (unsigned line = begin; line < end; ++line) {
+        const float* const next =
+          line < linesA ? &matA.mat[(row + line / rowLines) * matA.rowSpan
+                                    + line % rowLines * lineFloats]
+                        : &matBT.mat[(col + (line - linesA) / rowLines) * matBT.rowSpan
+                                     + (line - linesA) % rowLines * lineFloats];
+        _mm_prefetch((const char*)next, _MM_HINT_T1);
+    }
+}
+
+/* Columns [*first, *last) of [begin, end) of a row of C, the whole cache lines in it.
+ * Rows of C are cache line aligned relative to each other, it's the same for every
+ * row. If there is no whole line, both are end. */
+static void MMHelper_WholeLines(const float* const rowC, const unsigned begin,
+                                const unsigned end, unsigned* const first,
+                                unsigned* const last)
+{
+    const unsigned lineFloats = 64 / sizeof(float);
+    const unsigned beginOffset = (uintptr_t)&rowC[begin] / sizeof(float) % lineFloats;
+    *first = begin + (lineFloats - beginOffset) % lineFloats;
+    *last = end - (uintptr_t)&rowC[end] / sizeof(float) % lineFloats;
+    if (*first >= *last)
+        *first = *last = end;
+}
+
+/* Copy a row of w floats to C, whole cache lines with non-temporal stores, the partial
+ * lines at the ends normally. Needs a _mm_sfence() before C is read elsewhere. */
+__declspec(noalias) void MMHelper_StreamRow(const float* __restrict const src,
+                                            float* __restrict const out,
+                                            const unsigned w)
+{
+    int c = 0;
+    for (; c < w && ((uintptr_t)&out[c] & 63); ++c) {
+        out[c] = src[c];
+    }
+    for (; c + 16 <= w; c += 16) {
+        _mm256_stream_ps(&out[c], _mm256_loadu_ps(&src[c]));
+        _mm256_stream_ps(&out[c + 8], _mm256_loadu_ps(&src[c + 8]));
+    }
+    for (; c < w; ++c) {
+        out[c] = src[c];
+    }
+}
+
+/*
+ * Store a 4 row strip of an L2 block at (col, row) of a streamed block, computed into
+ * strip. The whole cache lines inside the L2 block are streamed into C right away,
+ * while the strip is in L1. The lines shared with the neighbouring L2 blocks are
+ * gathered in the tile, see MMHelper_StreamEdges. Rows and columns of the L2 block
+ * past the streamed block are dropped, they belong to the next block.
+ */
+__declspec(noalias) void MMHelper_StreamStrip(const MMStreamBlock& stream,
+                                              const float* __restrict const strip,
+                                              const unsigned stripSpan,
+                                              const unsigned col, const unsigned row,
+                                              const unsigned L2BlockX)
+{
+    const unsigned begin = col - stream.colC, blockRow = row - stream.rowC;
+    const unsigned end = min(begin + L2BlockX, stream.width);
+    unsigned first, last;
+    MMHelper_WholeLines(stream.c, begin, end, &first, &last);
+
+    for (unsigned r = 0; r < 4 && blockRow + r < stream.height; ++r) {
+        const float* const src = &strip[r * stripSpan];
+        float* const out = &stream.c[(blockRow + r) * stream.cSpan];
+        float* const edges = &stream.tile[(blockRow + r) * stream.tileSpan];
+        for (unsigned c = first; c < last; c += 8) {
+            _mm256_stream_ps(&out[c], _mm256_loadu_ps(&src[c - begin]));
+        }
+        for (unsigned c = begin; c < first; ++c) {
+            edges[c] = src[c - begin];
+        }
+        for (unsigned c = last; c < end; ++c) {
+            edges[c] = src[c - begin];
+        }
+    }
+}
+
+/* Store the lines gathered in the tile of a streamed block once all of its L2 blocks
+ * are done: the lines between the whole lines of consecutive L2 blocks, streamed, and
+ * the partial lines at the edges of the block, shared with the neighbouring blocks. */
+__declspec(noalias) void MMHelper_StreamEdges(const MMStreamBlock& stream,
+                                              const unsigned L2BlockX)
+{
+    for (unsigned r = 0; r < stream.height; ++r) {
+        const float* const edges = &stream.tile[r * stream.tileSpan];
+        float* const out = &stream.c[r * stream.cSpan];
+        unsigned begin = 0, first, last;
+        for (unsigned col = 0; col < stream.width; col += L2BlockX) {
+            const unsigned end = min(col + L2BlockX, stream.width);
+            MMHelper_WholeLines(stream.c, col, end, &first, &last);
+            MMHelper_StreamRow(&edges[begin], &out[begin], first - begin);
+            begin = last;
+        }
+        MMHelper_StreamRow(&edges[begin], &out[begin], stream.width - begin);
+    }
+
+    /* streaming stores are weakly ordered, make them visible before the job ends */
+    _mm_sfence();
+}
+
+/* 
+ * Compute L2Y x L2X sized blocks from the output matrix C, written to dst.
+ * In order to keep this code nice and hot in instruction cache,
+ * keep it restricted to full blocks of L2X x L2Y.
+ *
+ * The A rows and B^T rows of the next L2 block at (nextRow, nextCol) are prefetched
+ * into L2 meanwhile, the ones that differ from this block's. The prefetches are spread
+ * evenly over the 4x3 calls, replacing the A strips this block is done with gradually
+ * instead of flooding the memory system at once. Pass (col, row) if there's none.
+ *
+ * If stream is given, dst is unused, each 4 row strip is computed into a buffer on the
+ * stack and stored with MMHelper_StreamStrip.
+ */
+__declspec(noalias) void MMHelper_MultL2Blocks(float* __restrict const dst,
+                                               const unsigned dstSpan, const Mat& matA,
+                                               const Mat& matBT, const unsigned col,
+                                               const unsigned row,
+                                               const unsigned L2BlockX,
+                                               const unsigned L2BlockY, const int addToC,
+                                               const unsigned nextCol,
+                                               const unsigned nextRow,
+                                               const MMStreamBlock* const stream)
+{
+    /* cache lines of the next block, A lines first, then B^T lines */
+    const unsigned lineFloats = cacheLineSz / sizeof(float);
+    const unsigned rowLines = (matA.width + lineFloats - 1) / lineFloats;
+    const unsigned linesA = (doL2Prefetch && nextRow != row) ? L2BlockY * rowLines : 0;
+    const unsigned linesBT = (doL2Prefetch && nextCol != col) ? L2BlockX * rowLines : 0;
+    const unsigned numCalls = (L2BlockY / 4) * (L2BlockX / 3);
+    const unsigned linesPerCall = (linesA + linesBT + numCalls - 1) / numCalls;
+    unsigned line = 0;
+
+    /* L2BlockX is at most 30 */
+    constexpr unsigned stripSpan = 32;
+    __declspec(align(64)) float strip[4 * stripSpan];
+
+    /* multiply 4x3 blocks, L2blockX == 3*k, L2blockY == 4*m */
+    for (int blockRow = 0; blockRow < L2BlockY; blockRow += 4) {
+        for (int blockCol = 0; blockCol < L2BlockX; blockCol += 3) {
+            if constexpr (doL2Prefetch) {
+                const unsigned end = min(line + linesPerCall, linesA + linesBT);
+                MMHelper_PrefetchL2Block(matA, matBT, nextCol, nextRow, linesA, line, end);
+                line = end;
+            }
+            if (stream) {
+                MMHelper_Mult4x3Blocks(&strip[blockCol], stripSpan, matA, matBT,
+                                       col + blockCol, row + blockRow, 0);
+            } else {
+                MMHelper_Mult4x3Blocks(&dst[blockRow * dstSpan + blockCol], dstSpan,
+                                       matA, matBT, col + blockCol, row + blockRow,
+                                       addToC);
+            }
+        }
+        if (stream) {
+            MMHelper_StreamStrip(*stream, strip, stripSpan, col, row + blockRow,
+                                 L2BlockX);
+        }
+    }
+}
+
+/* Compute K x K sized blocks from the output matrix C. see struct mmBlockInfo */
+__declspec(noalias) void MMHelper_MultFullBlocks(float* __restrict const matData,
+                                                 const unsigned rowSpan,
+                                                 const Mat& matA, const Mat& matBT,
+                                                 const unsigned colC,
+                                                 const unsigned rowC,
+                                                 const MMBlockInfo& mmBlockInfo,
+                                                 const int addToC, const int streamC,
+                                                 std::atomic<unsigned>* const progress)
+{
+    const unsigned L2BlockX = mmBlockInfo.L2BlockX, L2BlockY = mmBlockInfo.L2BlockY,
+                   L3BlockX = mmBlockInfo.L3BlockX, L3BlockY = mmBlockInfo.L3BlockY,
+                   issuedBlockSzX = mmBlockInfo.issuedBlockSzX,
+                   issuedBlockSzY = mmBlockInfo.issuedBlockSzY;
+
+    /* try to prefetch next bit of block into memory while still handling this one */
+    {
+        if constexpr (doL3Prefetch) {
+            std::unique_lock<std::mutex> lock(prefetchMutex);
+            int alreadyPrefetchedCol =
+              prefetched[rowC / L3BlockY][colC / issuedBlockSzX];
+            lock.unlock();
+            if (!alreadyPrefetchedCol) {
+                for (int c = colC + issuedBlockSzX; c < colC + issuedBlockSzX; ++c) {
+                    for (int pos = 0; pos < matA.rowSpan;
+                         pos += cacheLineSz / sizeof(float)) {
+                        _mm_prefetch((const char*)&matBT.mat[c * matBT.rowSpan + pos],
+                                     _MM_HINT_T2);
+                    }
+                }
+                lock.lock();
+                prefetched[rowC / L3BlockY][colC / issuedBlockSzX]++;
+                lock.unlock();
+            }
+        }
+    }
+
+    /* when streaming, C isn't read back while it's being computed, so caching it only
+     * evicts the A and B panels. Lines of C are streamed as soon as an L2 block has
+     * them whole, only the lines L2 blocks share go through the tile. */
+    __declspec(align(64)) thread_local float tile[maxTileY * maxTileX];
+    float* __restrict const dst = &matData[rowC * rowSpan + colC];
+    const MMStreamBlock stream{
+      dst, rowSpan, colC, rowC, issuedBlockSzX, issuedBlockSzY, tile, maxTileX};
+
+    /* multiply L2YxL2X blocks, in column major order s.t consecutive blocks share
+     * their B^T rows, prefetching the block L2PrefetchDistance blocks ahead.
+     * With a helper thread the prefetching is left to it, progress is reported
+     * to it after each block instead. */
+    const unsigned blocksY = (issuedBlockSzY + L2BlockY - 1) / L2BlockY;
+    const unsigned numBlocks = (issuedBlockSzX + L2BlockX - 1) / L2BlockX * blocksY;
+    for (unsigned block = 0; block < numBlocks; ++block) {
+        const unsigned blockCol = block / blocksY * L2BlockX,
+                       blockRow = block % blocksY * L2BlockY;
+        const unsigned next = progress ? numBlocks : block + L2PrefetchDistance;
+        const unsigned nextCol = next < numBlocks ? next / blocksY * L2BlockX : blockCol,
+                       nextRow = next < numBlocks ? next % blocksY * L2BlockY : blockRow;
+
+        MMHelper_MultL2Blocks(&dst[blockRow * rowSpan + blockCol], rowSpan, matA, matBT,
+                              colC + blockCol, rowC + blockRow, L2BlockX, L2BlockY,
+                              addToC, colC + nextCol, rowC + nextRow,
+                              streamC ? &stream : NULL);
+
+        if (progress)
+            progress->fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (streamC)
+        MMHelper_StreamEdges(stream, L2BlockX);
+}
+
+/*
+ * The helper thread side of MMHelper_MultFullBlocks, run on the SMT sibling of the
+ * computing thread. Walks the same L2 blocks, prefetching each one into the shared L2
+ * once the computing thread is L2PrefetchDistance blocks away from it, as reported by
+ * progress, counted from base. Returns the number of blocks walked.
+ */
+__declspec(noalias) unsigned MMHelper_HelpFullBlocks(const Mat& matA, const Mat& matBT,
+                                                     const unsigned colC,
+                                                     const unsigned rowC,
+                                                     const MMBlockInfo& mmBlockInfo,
+                                                     const std::atomic<unsigned>& progress,
+                                                     const unsigned base,
+                                                     const std::atomic<int>& done)
+{
+    const unsigned L2BlockX = mmBlockInfo.L2BlockX, L2BlockY = mmBlockInfo.L2BlockY;
+    const unsigned blocksY = (mmBlockInfo.issuedBlockSzY + L2BlockY - 1) / L2BlockY;
+    const unsigned numBlocks =
+      (mmBlockInfo.issuedBlockSzX + L2BlockX - 1) / L2BlockX * blocksY;
+
+    const unsigned lineFloats = cacheLineSz / sizeof(float);
+    const unsigned rowLines = (matA.width + lineFloats - 1) / lineFloats;
+
+    for (unsigned block = 0; block < numBlocks; ++block) {
+        /* the helper runs after the work on cores without a sibling thread */
+        if (done.load(std::memory_order_relaxed))
+            return numBlocks;
+        /* don't run too far ahead, the prefetched lines would evict the ones in use.
+         * pause, s.t the spinning takes as few issue slots from the sibling as possible */
+        while (progress.load(std::memory_order_relaxed) + L2PrefetchDistance
+               <= base + block) {
+            if (done.load(std::memory_order_relaxed))
+                return numBlocks;
+            _mm_pause();
+        }
+
+        /* A rows change every block, B^T rows at the start of each block column */
+        const unsigned col = colC + block / blocksY * L2BlockX,
+                       row = rowC + block % blocksY * L2BlockY;
+        const unsigned linesA = L2BlockY * rowLines;
+        const unsigned linesBT = (block % blocksY == 0) ? L2BlockX * rowLines : 0;
+        MMHelper_PrefetchL2Block(matA, matBT, col, row, linesA, 0, linesA + linesBT);
+    }
+
+    return numBlocks;
+}
+
+/*
+ * A job of the multithreaded MatMul, a block of C computed by MMHelper_MultFullBlocks
+ * if full is set, or by MMHelper_MultAnyBlocks otherwise. Empty blocks are no-ops.
+ */
+typedef struct MMJob {
+    int full;
+    unsigned col, row;
+    int blockX, blockY;
+} MMJob;
+
+/*
+ * Shape specific decisions for C(N, K) = A(N, M) B(M, K), made once and reused
+ * by every ExecuteMatMulPlan call: which implementation to run, block sizes,
+ * the list of jobs for the thread pool and the workspace needed for the transpose of B.
+ */
+typedef struct MatMulPlan {
+    unsigned N, M, K;
+    /* the multithreaded method is used for large enough products */
+    int multithreaded;
+    /* the thread pool runs 2 threads per core */
+    int HTTEnabled;
+    MMBlockInfo mmBlockInfo;
+    /* each job holds 1 block per thread of a physical core */
+    std::vector<std::array<MMJob, 2>> jobs;
+    /* size of the L3 prefetch flags in use */
+    unsigned prefetchRows, prefetchCols;
+    /* bytes needed for the transpose of B */
+    size_t workspaceSize;
+    /* C doesn't fit in L3, full blocks are written with streaming stores */
+    int streamC;
+    /* SMT siblings prefetch for the computing thread of each core, see htHelperMode */
+    int htHelper;
+    /* order the L3 blocks of C are issued in */
+    MMJobOrder jobOrder;
+    /* thread pool core group (L3 domain) of each job, all jobs of an L3 block share one */
+    std::vector<unsigned> jobGroups;
+    /* thread pool partition the jobs run on, see SetMatMulPartition */
+    unsigned partition;
+    /* thread pool priority class of the jobs, see SetMatMulPriority */
+    int priority;
+} MatMulPlan;
+
+/* Index of (x, y) along the Morton (Z order) curve */
+static uint64_t MMHelper_MortonIndex(const unsigned x, const unsigned y)
+{
+    uint64_t d = 0;
+    for (int bit = 0; bit < 32; ++bit) {
+        d |= (uint64_t)((x >> bit) & 1) << (2 * bit);
+        d |= (uint64_t)((y >> bit) & 1) << (2 * bit + 1);
+    }
+    return d;
+}
+
+/* Index of (x, y) along the Hilbert curve covering an n x n grid, n is a power of 2 */
+static uint64_t MMHelper_HilbertIndex(const unsigned n, unsigned x, unsigned y)
+{
+    uint64_t d = 0;
+    for (unsigned s = n / 2; s > 0; s /= 2) {
+        const unsigned rx = (x & s) > 0, ry = (y & s) > 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        /* rotate the quadrant s.t the curve stays continuous */
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+/*
+ * Assign the jobs of the plan to the core groups of the thread pool (the L3 domains),
+ * all jobs of an L3 block to a single group s.t its A and B^T bands are loaded
+ * into a single L3. Each group gets a contiguous run of L3 blocks in issue order,
+ * with a share of the jobs matching its share of the core capacity (efficiency cores
+ * of hybrid CPUs count half), s.t it works on a compact region of C.
+ * The jobs are then interleaved between the groups, s.t every group's queue
+ * fills up from the start instead of idle groups stealing the first group's jobs.
+ */
+static void MMHelper_AssignGroups(MatMulPlan& plan,
+                                  const std::vector<uint64_t>& jobBlocks)
+{
+    const int numDomains = CPUUtil::GetNumL3Domains();
+    const unsigned numGroups = numDomains > 1 ? numDomains : 1;
+    plan.jobGroups.assign(plan.jobs.size(), 0);
+    if (numGroups < 2)
+        return;
+
+    /* core capacity of each group and the prefix sums of them */
+    std::vector<uint64_t> groupCapacity(numGroups + 1, 0);
+    HWLocalThreadPool& tp = GetThreadPool();
+    for (unsigned i = 0; i < tp.NumCoreHandlers(); ++i) {
+        if (tp.PartitionOfCore(i) != plan.partition)
+            continue;
+        const int domain = tp.GroupOfCore(i);
+        const int capacity = CPUUtil::GetCoreCapacity(tp.HWCoreOfHandler(i));
+        groupCapacity[1 + (domain > 0 ? domain : 0)] += capacity > 0 ? capacity : 1024;
+    }
+    std::partial_sum(groupCapacity.begin(), groupCapacity.end(), groupCapacity.begin());
+
+    /* the group of an L3 block follows from the position of its first job */
+    const uint64_t numJobs = plan.jobs.size();
+    std::vector<std::vector<unsigned>> groupJobs(numGroups);
+    unsigned group = 0;
+    for (size_t i = 0; i < plan.jobs.size(); ++i) {
+        if (i == 0 || jobBlocks[i] != jobBlocks[i - 1]) {
+            while (group + 1 < numGroups &&
+                   i * groupCapacity[numGroups] >= numJobs * groupCapacity[group + 1]) {
+                ++group;
+            }
+        }
+        groupJobs[group].push_back(i);
+    }
+
+    std::vector<std::array<MMJob, 2>> jobs;
+    jobs.reserve(plan.jobs.size());
+    plan.jobGroups.clear();
+    for (size_t pos = 0; jobs.size() < plan.jobs.size(); ++pos) {
+        for (unsigned g = 0; g < numGroups; ++g) {
+            if (pos < groupJobs[g].size()) {
+                jobs.push_back(plan.jobs[groupJobs[g][pos]]);
+                plan.jobGroups.push_back(g);
+            }
+        }
+    }
+    plan.jobs.swap(jobs);
+}
+
+/* Decide the block sizes for the given inner dimension and the runtime CPU. */
+static MMBlockInfo MMHelper_BlockInfo(const unsigned M)
+{
+    const float invN = 1.0 / RoundUpPwr2(M, 64 / sizeof(float));
+
+    int QL2 = invN * L2Size / sizeof(float);
+    int QL3 = invN * L3Size / sizeof(float);
+    int k = min(max(QL2 / 6, 1), 10);
+    int m = min(max(QL2 / 8, 1), 10);
+    int L2BlockX = 3 * k;
+    int L2BlockY = 4 * m;
+    int lcmMN = std::lcm(k, m);
+    int L3BlockX = min(max(QL3 / 120 / lcmMN * lcmMN * 60, 12*L2BlockX), 360);
+    int L3BlockY = L3BlockX;
+    int issuedBlockSzX = L3BlockX / 4;
+    int issuedBlockSzY = L3BlockY / 3;
+
+    /*printf("%d %d %d %d %d %d\n", L2BlockX, L2BlockY, issuedBlockSzX, issuedBlockSzY,
+           L3BlockX, L3BlockY);*/
+
+    return {(unsigned)L3BlockX,       (unsigned)L3BlockY,      (unsigned)L2BlockX,
+            (unsigned)L2BlockY, (unsigned)issuedBlockSzX, (unsigned)issuedBlockSzY};
+}
+
+/* Create the plan for multiplying A(N, M) with B(M, K). */
+const MatMulPlan MakeMatMulPlan(const unsigned N, const unsigned M, const unsigned K)
+{
+    /* if CPU information is not already queried, do so */
+    QueryCPUInfo();
+
+    const MMBlockInfo mmBlockInfo = MMHelper_BlockInfo(M);
+
+    MatMulPlan plan{N,
+                    M,
+                    K,
+                    (uint64_t)N * M * K >= STMatMulThreshold,
+                    poolThreadsPerCore > 1,
+                    mmBlockInfo,
+                    {},
+                    0,
+                    0,
+                    (size_t)K * RoundUpPwr2(M, 64 / sizeof(float)) * sizeof(float),
+                    (size_t)N * K * sizeof(float) > L3Size,
+                    poolThreadsPerCore > 1 && htHelperMode,
+                    mmJobOrder,
+                    {},
+                    mmPartition,
+                    mmPriority};
+
+    if (!plan.multithreaded)
+        return plan;
+
+    /* shorthand for the block sizes, signed to avoid UB with unsigned dimensions */
+    const int L3BlockX = mmBlockInfo.L3BlockX, L3BlockY = mmBlockInfo.L3BlockY,
+              issuedBlockSzX = mmBlockInfo.issuedBlockSzX,
+              issuedBlockSzY = mmBlockInfo.issuedBlockSzY;
+    const int HTTEnabled = plan.HTTEnabled;
+    const int jobStride = (1 << HTTEnabled);
+    const MMJob noop{0, 0, 0, 0, 0};
+
+    assert(issuedBlockSzX <= maxTileX && issuedBlockSzY <= maxTileY);
+
+    plan.prefetchRows = N / L3BlockY + 1;
+    plan.prefetchCols = K / issuedBlockSzX + 1;
+    /* the L3 prefetch flags only limit the size of C when they're in use */
+    if constexpr (doL3Prefetch) {
+        assert(plan.prefetchRows <= 1024 && plan.prefetchCols <= 1024);
+    }
+
+    /* the position of each job's L3 block along the curve, the side of the curve's
+     * grid is a power of 2 covering all L3 blocks, edges included */
+    std::vector<uint64_t> jobKeys, jobBlocks;
+    unsigned gridSz = 1;
+    while (gridSz < N / L3BlockY + 1 || gridSz < K / L3BlockX + 1) {
+        gridSz *= 2;
+    }
+    auto Issue = [&](const MMJob& first, const MMJob& second) {
+        const unsigned x = first.col / L3BlockX, y = first.row / L3BlockY;
+        plan.jobs.push_back({{first, second}});
+        jobBlocks.push_back((uint64_t)y * gridSz + x);
+        jobKeys.push_back(plan.jobOrder == MM_ORDER_HILBERT
+                            ? MMHelper_HilbertIndex(gridSz, x, y)
+                            : plan.jobOrder == MM_ORDER_MORTON ? MMHelper_MortonIndex(x, y)
+                                                               : 0);
+    };
+
+    /*
+     * We incorporate multiple levels of tiling into our traversal.
+     *
+     * If we issue commands linearly, we'll have poor L3 cache utilization.
+     * [ [C0T0 | C0T1] [C1T0 | C1T1] ... [C5T0 | C5T1] ] covering a rows, b columns,
+     * (a+b)N floats of data is needed to compute a*b sized block.
+     * So, instead, we issue commands in the blocked manner, like:
+     * [ [C0T0 | C0T1] [C1T0 | C1T1] 
+     *   [C2T0 | C5T1] [C2T0 | C2T1] ] 
+     *
+     * Traverse L3 sized blocks, 
+     * inside each, issue issuedBlockSz sized blocks.
+     */
+
+    int rowC = 0;
+    /* handle L3Y sized rows */
+    for (; rowC <= (int)N - L3BlockY; rowC += L3BlockY) {
+        int colC = 0;
+        /* handle L3Y x L3X sized blocks */
+        for (; colC <= (int)K - L3BlockX; colC += L3BlockX) {
+            /* Issue issuedBlockSzY x issuedBlockSzX sized blocks */
+            for (int blockRowC = rowC; blockRowC < rowC + L3BlockY;
+                 blockRowC += issuedBlockSzY) {
+                for (int blockColC = colC; blockColC < colC + L3BlockX;
+                     blockColC += jobStride * issuedBlockSzX) {
+                    const MMJob second{1, (unsigned)(blockColC + issuedBlockSzX),
+                                       (unsigned)blockRowC, 0, 0};
+                    Issue({1, (unsigned)blockColC, (unsigned)blockRowC, 0, 0},
+                          HTTEnabled ? second : noop);
+                }
+            }
+        }
+        /* handle the block w < L3X, h = L3Y at the end of the row */
+        if ((int)K > colC) {
+            const int remSubX = (K - colC) >> HTTEnabled;
+            Issue({0, (unsigned)colC, (unsigned)rowC, remSubX, L3BlockY},
+                  {0, (unsigned)(colC + remSubX), (unsigned)rowC, (int)K - colC - remSubX,
+                   L3BlockY});
+        }
+    }
+    /* handle last row, h < L3Y */
+    int colC = 0;
+    /* first handle blocks of w = L3X, h < L3Y */
+    for (; colC <= (int)K - L3BlockX; colC += jobStride * issuedBlockSzX) {
+        const MMJob second{0, (unsigned)(colC + issuedBlockSzX), (unsigned)rowC,
+                           issuedBlockSzX, (int)N - rowC};
+        Issue({0, (unsigned)colC, (unsigned)rowC, issuedBlockSzX, (int)N - rowC},
+              HTTEnabled ? second : noop);
+    }
+    /* now handle the rightmost block of w < L3X, h < L3Y */
+    Issue({0, (unsigned)colC, (unsigned)rowC, (int)K - colC, (int)N - rowC}, noop);
+
+    /* reorder the L3 blocks along the curve, the jobs inside each keep their order */
+    if (plan.jobOrder != MM_ORDER_ROWS) {
+        std::vector<unsigned> order(plan.jobs.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](const unsigned a, const unsigned b) {
+            return jobKeys[a] < jobKeys[b];
+        });
+
+        std::vector<std::array<MMJob, 2>> jobs;
+        std::vector<uint64_t> blocks;
+        jobs.reserve(order.size());
+        blocks.reserve(order.size());
+        for (const unsigned i : order) {
+            jobs.push_back(plan.jobs[i]);
+            blocks.push_back(jobBlocks[i]);
+        }
+        plan.jobs.swap(jobs);
+        jobBlocks.swap(blocks);
+    }
+
+    MMHelper_AssignGroups(plan, jobBlocks);
+
+    return plan;
+}
+
+/* Compute a single block of the plan. */
+static void MMHelper_RunJob(const MMJob& job, float* __restrict const matData,
+                            const unsigned rowSpan, const Mat& matA, const Mat& matBT,
+                            const MMBlockInfo& mmBlockInfo, const int addToC,
+                            const int streamC, std::atomic<unsigned>* const progress = NULL)
+{
+    if (job.full) {
+        MMHelper_MultFullBlocks(matData, rowSpan, matA, matBT, job.col, job.row,
+                                mmBlockInfo, addToC, streamC, progress);
+    } else {
+        MMHelper_MultAnyBlocks(matData, rowSpan, matA, matBT, job.col, job.row,
+                               job.blockX, job.blockY, mmBlockInfo, addToC);
+    }
+}
+
+/* Whether the cancellation flag of a multiplication is set, see MatMulAsync */
+static inline bool MMHelper_Cancelled(const std::atomic<int>* const cancel)
+{
+    return cancel && cancel->load(std::memory_order_relaxed);
+}
+
+/*
+ * Issue the jobs of a multithreaded plan to the cache aware thread pool
+ * and wait for them. Takes B already transposed,
+ * if addToC is set, the product is added onto the existing values of C.
+ * Once *cancel is set, the remaining jobs are skipped and C is left incomplete.
+ */
+__declspec(noalias) void MTMatMulBT(const MatMulPlan& plan, const Mat& matA,
+                                    const Mat& matBT, const Mat& matC, const int addToC,
+                                    const std::atomic<int>* const cancel = NULL)
+{
+    /* output is written into the caller's matrix C */
+    float* __restrict const matData = matC.mat;
+    const unsigned rowSpan = matC.rowSpan;
+
+    const MMBlockInfo& mmBlockInfo = plan.mmBlockInfo;
+    const unsigned L3BlockX = mmBlockInfo.L3BlockX, L3BlockY = mmBlockInfo.L3BlockY;
+
+    /* streamed blocks overwrite C, they can't accumulate onto it */
+    const int streamC = plan.streamC && !addToC;
+
+    /* the shared pool runs 1 or 2 threads per physical core, depending on HTT status */
+    HWLocalThreadPool& tp = GetThreadPool();
+
+    /* nested in a busy pool, compute the jobs in order on this thread */
+    if (MMHelper_RunInline(tp, plan.partition)) {
+        for (const auto& job : plan.jobs) {
+            if (MMHelper_Cancelled(cancel))
+                return;
+            for (const MMJob& block : job) {
+                MMHelper_RunJob(block, matData, rowSpan, matA, matBT, mmBlockInfo, addToC,
+                                streamC);
+            }
+        }
+        return;
+    }
+
+    /* before we begin, start prefetching the first L3 level block */
+    if constexpr (doL3Prefetch) {
+        /* reset the prefetched flags this plan uses */
+        for (int r = 0; r < plan.prefetchRows; ++r) {
+            memset(&prefetched[r][0], 0, plan.prefetchCols * sizeof(int));
+        }
+    }
+    /* prefetch rows of A and columns of B, one cache line at a time */
+    for (int r = 0; r < min(L3BlockY, matA.height); ++r) {
+        for (int pos = 0; pos < matA.rowSpan; pos += cacheLineSz / sizeof(float)) {
+            _mm_prefetch((const char*)&matA.mat[r * matA.rowSpan + pos], _MM_HINT_T2);
+        }
+    }
+    for (int c = 0; c < min(L3BlockX, matBT.height); ++c) {
+        for (int pos = 0; pos < matA.rowSpan; pos += cacheLineSz / sizeof(float)) {
+            _mm_prefetch((const char*)&matBT.mat[c * matBT.rowSpan + pos], _MM_HINT_T2);
+        }
+    }
+    /* prefetch is called for the first block, mark it. */
+    prefetched[0][0]++;
+
+    /* the calling thread runs jobs of this multiplication too while waiting for it */
+    HWLocalThreadPool::JobBatch batch;
+    /* jobs are issued lazily, at most window of them queued, see mmIssueWindow */
+    const unsigned window =
+      mmIssueWindow * max(tp.NumCoresOfPartition(plan.partition), 1u);
+
+    /* in helper thread mode, one thread computes both blocks of a job,
+     * its siblings prefetch for it */
+    if (plan.htHelper) {
+        for (size_t i = 0; i < plan.jobs.size(); ++i) {
+            if (MMHelper_Cancelled(cancel))
+                break;
+            if (i >= window)
+                tp.WaitBatch(batch, window - 1);
+            const MMJob first = plan.jobs[i][0], second = plan.jobs[i][1];
+            auto progress = std::make_shared<std::atomic<unsigned>>(0);
+            tp.AddHelped(
+              [=, &matA, &matBT, &mmBlockInfo]() {
+                  if (MMHelper_Cancelled(cancel))
+                      return;
+                  MMHelper_RunJob(first, matData, rowSpan, matA, matBT, mmBlockInfo,
+                                  addToC, streamC, progress.get());
+                  MMHelper_RunJob(second, matData, rowSpan, matA, matBT, mmBlockInfo,
+                                  addToC, streamC, progress.get());
+              },
+              [=, &matA, &matBT, &mmBlockInfo](const std::atomic<int>& done) {
+                  /* only full blocks report progress */
+                  unsigned base = 0;
+                  if (first.full) {
+                      base = MMHelper_HelpFullBlocks(matA, matBT, first.col, first.row,
+                                                     mmBlockInfo, *progress, 0, done);
+                  }
+                  if (second.full) {
+                      MMHelper_HelpFullBlocks(matA, matBT, second.col, second.row,
+                                              mmBlockInfo, *progress, base, done);
+                  }
+              },
+              plan.jobGroups[i], &batch, plan.partition, plan.priority);
+        }
+        tp.WaitBatch(batch);
+        return;
+    }
+
+    /* start issuing jobs for the thread pool */
+    for (size_t i = 0; i < plan.jobs.size(); ++i) {
+        if (MMHelper_Cancelled(cancel))
+            break;
+        if (i >= window)
+            tp.WaitBatch(batch, window - 1);
+        const MMJob first = plan.jobs[i][0], second = plan.jobs[i][1];
+        tp.Add({[=, &matA, &matBT, &mmBlockInfo]() {
+                    if (MMHelper_Cancelled(cancel))
+                        return;
+                    MMHelper_RunJob(first, matData, rowSpan, matA, matBT, mmBlockInfo,
+                                    addToC, streamC);
+                },
+                [=, &matA, &matBT, &mmBlockInfo]() {
+                    if (MMHelper_Cancelled(cancel))
+                        return;
+                    MMHelper_RunJob(second, matData, rowSpan, matA, matBT, mmBlockInfo,
+                                    addToC, streamC);
+                }},
+               plan.jobGroups[i], &batch, plan.partition, plan.priority);
+    }
+
+    /* -- commands issued -- */
+
+    /* help the thread pool finish this multiplication, it's kept alive for the next */
+    tp.WaitBatch(batch);
+}
+
+/*
+ * Fault in the pages of a fresh C (see AllocMat) before the multiplication, each block
+ * of C on the core group whose cores compute it, s.t its pages are placed next to
+ * them. Otherwise the page faults are serialized in the kernel while the cores first
+ * write C in job order. Zeroes the padding AllocMat left, the rest of C is garbage.
+ */
+static void MMHelper_FirstTouch(const MatMulPlan& plan, const Mat& matC)
+{
+    constexpr uintptr_t pageSz = 4096;
+    const MMBlockInfo& info = plan.mmBlockInfo;
+
+    auto TouchBlock = [&matC, &info](const MMJob& block) {
+        const unsigned w = block.full ? info.issuedBlockSzX : max(block.blockX, 0);
+        const unsigned h = block.full ? info.issuedBlockSzY : max(block.blockY, 0);
+        const unsigned colEnd = min(block.col + w, (unsigned)matC.width);
+        const unsigned rowEnd = min(block.row + h, (unsigned)matC.height);
+        for (unsigned row = block.row; row < rowEnd && block.col < colEnd; ++row) {
+            float* const rowData = &matC.mat[(size_t)row * matC.rowSpan];
+            /* the first float of the block's part of the row and of each next page */
+            for (float* pos = &rowData[block.col]; pos < &rowData[colEnd];
+                 pos = (float*)(((uintptr_t)pos / pageSz + 1) * pageSz)) {
+                *pos = 0;
+            }
+            /* the blocks of the last columns zero the padding */
+            if (colEnd == matC.width)
+                memset(&rowData[matC.width], 0,
+                       (matC.rowSpan - matC.width) * sizeof(float));
+        }
+    };
+
+    HWLocalThreadPool& tp = GetThreadPool();
+    if (MMHelper_RunInline(tp, plan.partition)) {
+        for (const auto& job : plan.jobs) {
+            for (const MMJob& block : job) {
+                TouchBlock(block);
+            }
+        }
+        return;
+    }
+
+    /* blocks of each group, a pool job per core of the group touches a share of them */
+    const unsigned numGroups = tp.NumGroups();
+    std::vector<std::vector<MMJob>> groupBlocks(numGroups);
+    for (size_t i = 0; i < plan.jobs.size(); ++i) {
+        for (const MMJob& block : plan.jobs[i]) {
+            groupBlocks[plan.jobGroups[i] % numGroups].push_back(block);
+        }
+    }
+    std::vector<unsigned> groupCores(numGroups, 0);
+    for (unsigned i = 0; i < tp.NumCoreHandlers(); ++i) {
+        if (tp.PartitionOfCore(i) == plan.partition)
+            ++groupCores[tp.GroupOfCore(i) % numGroups];
+    }
+
+    HWLocalThreadPool::JobBatch batch;
+    const unsigned numThreads = tp.NumThreadsPerCore();
+    for (unsigned g = 0; g < numGroups; ++g) {
+        const std::vector<MMJob>& blocks = groupBlocks[g];
+        const unsigned numShares = max(groupCores[g], 1u) * numThreads;
+        for (unsigned core = 0; core < max(groupCores[g], 1u); ++core) {
+            std::vector<std::function<void()>> job;
+            for (unsigned t = 0; t < numThreads; ++t) {
+                const unsigned share = core * numThreads + t;
+                job.push_back([&blocks, &TouchBlock, share, numShares]() {
+                    for (size_t b = share; b < blocks.size(); b += numShares) {
+                        TouchBlock(blocks[b]);
+                    }
+                });
+            }
+            tp.Add(job, g, &batch, plan.partition, plan.priority);
+        }
+    }
+    tp.WaitBatch(batch);
+}
+
+/* Multithreaded MatMul with an already transposed B, plans for the given shapes.
+ * Products below the multithreading threshold get no jobs, they run singlethreaded. */
+__declspec(noalias) void MTMatMulBT(const Mat& matA, const Mat& matBT, const Mat& matC,
+                                    const int addToC)
+{
+    const MatMulPlan plan = MakeMatMulPlan(matA.height, matA.width, matBT.height);
+    if (!plan.multithreaded) {
+        ST_TransposedBMatMulBT(matA, matBT, matC, addToC);
+        return;
+    }
+    MTMatMulBT(plan, matA, matBT, matC, addToC);
+}
+
+/*
+ * Execute a plan for the given matrices, their shapes must match the plan's.
+ * workspace, if given, must be AVX aligned and hold plan.workspaceSize bytes,
+ * otherwise the transpose of B is allocated for the call.
+ * A multithreaded plan stops between block jobs once *cancel is set, see MatMulAsync.
+ * freshC tells that C was allocated by AllocMat as fresh, its pages are faulted in
+ * and its padding zeroed here then.
+ */
+void ExecuteMatMulPlan(const MatMulPlan& plan, const Mat& matA, const Mat& matB,
+                       const Mat& matC, float* const workspace = NULL,
+                       const std::atomic<int>* const cancel = NULL,
+                       const int freshC = 0)
+{
+    assert(matA.height == plan.N && matA.width == plan.M && matB.width == plan.K);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    auto Elapsed = [&start]() {
+        const auto end = std::chrono::high_resolution_clock::now();
+        const double us = std::chrono::duration<double, std::micro>(end - start).count();
+        start = end;
+        return us;
+    };
+    mmPhaseTimes = {0, 0, 0};
+
+    /* a C fresh from the pool is overwritten anyway, fault it in on all cores */
+    if (freshC) {
+        if (plan.multithreaded) {
+            MMHelper_FirstTouch(plan, matC);
+        } else {
+            ZeroMatPadding(matC);
+        }
+        mmPhaseTimes.firstTouch = Elapsed();
+    }
+
+    const unsigned tRowSpan = RoundUpPwr2(matB.height, 64 / sizeof(float));
+    MatAllocator& allocator = GetMatAllocator();
+    const Mat matBT{matB.height, matB.width, tRowSpan,
+                    workspace ? workspace
+                              : (float*)allocator.Alloc(plan.workspaceSize)};
+
+    if (plan.multithreaded) {
+        MTTransposeMat(matB, matBT, plan.partition, plan.priority);
+        mmPhaseTimes.transpose = Elapsed();
+        MTMatMulBT(plan, matA, matBT, matC, 0, cancel);
+    } else {
+        TransposeMat(matB, matBT);
+        mmPhaseTimes.transpose = Elapsed();
+        ST_TransposedBMatMulBT(matA, matBT, matC, 0);
+    }
+    mmPhaseTimes.multiply = Elapsed();
+
+    if (!workspace)
+        allocator.Free(matBT.mat);
+}
+
+/* Multithreaded MatMul, writes into the given matC. */
+__declspec(noalias) void MTMatMul(const Mat& matA, const Mat& matB, const Mat& matC)
+{
+    /* for the sake of cache, we'll be working with transposed B */
+    MatAllocator& allocator = GetMatAllocator();
+    const Mat matBT = TransposeMat(matB, allocator);
+
+    MTMatMulBT(matA, matBT, matC, 0);
+
+    /* free the temporary bT matrix */
+    allocator.Free(matBT.mat);
+}
+
+/* Multithreaded MatMul, allocates the output matrix C. */
+__declspec(noalias) const Mat MTMatMul(const Mat& matA, const Mat& matB)
+{
+    /* allocate our new matrix C, with zeroed padding */
+    const Mat matC = AllocMat(matB.width, matA.height);
+
+    MTMatMul(matA, matB, matC);
+
+    return matC;
+}
+
+/* MatMul function, a simple branch that calls the proper implementation
+ * based on the complexity of the input matrix. Writes into the given matC. */
+void MatMul(const Mat& matA, const Mat& matB, const Mat& matC)
+{
+    /* 
+     * If complexity is low enough, the plan uses
+     * the single threaded, transposed B method.
+     * A(N, M) B(M, K) => # of ops ~= 2*N*K*M 
+     */
+    ExecuteMatMulPlan(MakeMatMulPlan(matA.height, matA.width, matB.width), matA, matB,
+                      matC);
+}
+
+/* Same as above, but allocates and returns the product. */
+Matrix MatMul(const Mat& matA, const Mat& matB)
+{
+    int fresh;
+    Matrix matC(matB.width, matA.height, GetMatAllocator(), &fresh);
+    ExecuteMatMulPlan(MakeMatMulPlan(matA.height, matA.width, matB.width), matA, matB,
+                      matC, NULL, NULL, fresh);
+    return matC;
+}
+
+/* Shared state of a multiplication started by MatMulAsync */
+typedef struct MatMulAsyncState {
+    Matrix matC;
+    /* thread pool partition and priority class of the multiplication */
+    unsigned partition;
+    int priority;
+    std::atomic<int> cancel{0};
+    std::mutex mutex;
+    std::condition_variable doneNotifier;
+    /* guarded by mutex */
+    int done = 0;
+    std::vector<std::function<void(const Mat&, bool)>> callbacks;
+} MatMulAsyncState;
+
+/*
+ * Handle of a multiplication running in the thread pool, see MatMulAsync.
+ * Copies share the multiplication, it keeps running if every handle is dropped.
+ */
+class MatMulFuture {
+public:
+    MatMulFuture() {}
+    explicit MatMulFuture(std::shared_ptr<MatMulAsyncState> state) : m_state(state) {}
+
+    bool valid() const
+    {
+        return m_state != nullptr;
+    }
+
+    /* Block until the multiplication is done or cancelled. */
+    void wait() const
+    {
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        while (!m_state->done) {
+            m_state->doneNotifier.wait(lock);
+        }
+    }
+
+    /* Block for at most timeout, returns whether the multiplication is done. */
+    template <typename Rep, typename Period>
+    bool wait_for(const std::chrono::duration<Rep, Period>& timeout) const
+    {
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        return m_state->doneNotifier.wait_for(lock, timeout,
+                                              [this]() { return m_state->done != 0; });
+    }
+
+    bool ready() const
+    {
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        return m_state->done != 0;
+    }
+
+    /* Request cancellation, the block jobs not started yet are skipped.
+     * Cooperative: blocks being computed finish, and C is left incomplete. */
+    void cancel()
+    {
+        m_state->cancel.store(1, std::memory_order_relaxed);
+    }
+
+    bool cancelled() const
+    {
+        return m_state->cancel.load(std::memory_order_relaxed) != 0;
+    }
+
+    /* Call callback(C, cancelled) once the multiplication is done, on the pool thread
+     * that finishes it before wait() returns, or right away on this thread if it's
+     * done already. */
+    void then(const std::function<void(const Mat&, bool)>& callback)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_state->mutex);
+            if (!m_state->done) {
+                m_state->callbacks.push_back(callback);
+                return;
+            }
+        }
+        callback(m_state->matC, cancelled());
+    }
+
+    /* Wait and take the product, the handle is invalid afterwards. */
+    Matrix get()
+    {
+        wait();
+        Matrix matC = std::move(m_state->matC);
+        m_state.reset();
+        return matC;
+    }
+
+#ifdef __cpp_impl_coroutine
+    /* co_await MatMulAsync(A, B) suspends the calling coroutine until the product is
+     * done and gives it, continuing as a pool job of the multiplication's partition
+     * and priority. No thread blocks for it meanwhile. */
+    bool await_ready() const
+    {
+        return ready();
+    }
+
+    void await_suspend(const std::coroutine_handle<> handle)
+    {
+        /* callbacks run before the future is done, resume in a job of its own */
+        const unsigned partition = m_state->partition;
+        const int priority = m_state->priority;
+        then([=](const Mat&, bool) {
+            GetThreadPool().AddResume(handle, 0, partition, priority);
+        });
+    }
+
+    Matrix await_resume()
+    {
+        return get();
+    }
+#endif
+
+private:
+    std::shared_ptr<MatMulAsyncState> m_state;
+};
+
+/*
+ * Start A * B on the thread pool and return without waiting for it, callback (if
+ * given) is called with the product like MatMulFuture::then. The data of A and B
+ * must stay alive until it's done. The plan, with the partition and priority of the
+ * calling thread, is made here, a pool job executes it and its block jobs are
+ * interleaved with the other work of the pool. Cancellation is checked before each
+ * block job.
+ */
+MatMulFuture
+MatMulAsync(const Mat& matA, const Mat& matB,
+            const std::function<void(const Mat&, bool)>& callback = nullptr)
+{
+    auto state = std::make_shared<MatMulAsyncState>();
+    int fresh;
+    state->matC = Matrix(matB.width, matA.height, GetMatAllocator(), &fresh);
+    if (callback)
+        state->callbacks.push_back(callback);
+
+    const MatMulPlan plan = MakeMatMulPlan(matA.height, matA.width, matB.width);
+    HWLocalThreadPool& tp = GetThreadPool();
+    state->partition = plan.partition;
+    state->priority = plan.priority;
+
+    /* the executing job runs on the main thread of a core, its siblings idle */
+    std::vector<std::function<void()>> job(tp.NumThreadsPerCore(), []() {});
+    job[0] = [=]() {
+        if (!MMHelper_Cancelled(&state->cancel))
+            ExecuteMatMulPlan(plan, matA, matB, state->matC, NULL, &state->cancel,
+                              fresh);
+
+        /* callbacks run before waiters are released, get() takes C away */
+        std::vector<std::function<void(const Mat&, bool)>> callbacks;
+        while (1) {
+            {
+                std::unique_lock<std::mutex> lock(state->mutex);
+                if (state->callbacks.empty()) {
+                    state->done = 1;
+                    state->doneNotifier.notify_all();
+                    break;
+                }
+                callbacks.swap(state->callbacks);
+            }
+            for (const auto& f : callbacks) {
+                f(state->matC, MMHelper_Cancelled(&state->cancel));
+            }
+            callbacks.clear();
+        }
+    };
+    tp.Add(job, 0, NULL, plan.partition, plan.priority);
+
+    return MatMulFuture(state);
+}
+
+/* MatMul with an already transposed B, writes (or adds if addToC is set) into matC. */
+void MatMulBT(const Mat& matA, const Mat& matBT, const Mat& matC, const int addToC)
+{
+    if ((uint64_t)matA.height * matA.width * matBT.height < STMatMulThreshold) {
+        ST_TransposedBMatMulBT(matA, matBT, matC, addToC);
+    } else {
+        MTMatMulBT(matA, matBT, matC, addToC);
+    }
+}
+
+/* Operation flags for MatMulEx */
+enum MMOpFlags {
+    MM_TRANS_A = 1 << 0,    /* use the transpose of A */
+    MM_TRANS_B = 1 << 1,    /* use the transpose of B */
+    MM_ACCUMULATE = 1 << 2  /* add the product onto the existing values of C */
+};
+
+/*
+ * General MatMul, C = op(A) * op(B), or C += op(A) * op(B) with MM_ACCUMULATE.
+ * The kernels work on the transpose of B, so a transposed B comes for free
+ * and is used as is, only a transposed A is materialized.
+ * A transposed B that is a view narrower than its parent is copied,
+ * the parent's columns would be read as its padding.
+ */
+void MatMulEx(const Mat& matA, const Mat& matB, const Mat& matC, const unsigned flags)
+{
+    const int transB = (flags & MM_TRANS_B) ? 1 : 0;
+    const int copyB = transB && matB.rowSpan != RoundUpPwr2(matB.width, 64 / sizeof(float));
+
+    MatAllocator& allocator = GetMatAllocator();
+    const Mat opA = (flags & MM_TRANS_A) ? TransposeMat(matA, allocator) : matA;
+    const Mat matBT = transB ? (copyB ? CopyMat(matB, allocator) : matB)
+                             : TransposeMat(matB, allocator);
+    const int addToC = (flags & MM_ACCUMULATE) ? 1 : 0;
+
+    assert(opA.width == matBT.width);
+
+    MatMulBT(opA, matBT, matC, addToC);
+
+    if (flags & MM_TRANS_A)
+        allocator.Free(opA.mat);
+    if (!transB || copyB)
+        allocator.Free(matBT.mat);
+}
+
+/*
+ * Estimate the cost of computing A(N, M) B(M, K) with MatMul, in core cycles.
+ * Unlike a plain flop count, this follows the implementation that MatMul dispatches to:
+ *   - the inner dimension is padded to the row span, kernels run over whole vectors,
+ *   - the single threaded method is bound by its 2 loads per fma,
+ *   - the multithreaded method computes 4x3 blocks with 2 fma/cycle on every core
+ *     and transposes B on all of them too (MTTransposeMat), but pays for waking the
+ *     sleeping cores of the pool, which stays alive between calls,
+ *   - both write C through the memory hierarchy, bound by bandwidth, not cores.
+ */
+static double MMEstimateCost(const unsigned N, const unsigned M, const unsigned K)
+{
+    QueryCPUInfo();
+
+    const double paddedM = RoundUpPwr2(M, 64 / sizeof(float));
+    const double floatsPerLine = cacheLineSz / sizeof(float);
+
+    /* strided reads miss on every element once B stops fitting in the cache */
+    const double transposeCost = (double)M * K * (M * K * sizeof(float) > L2Size ? 4 : 1);
+    const double writeCCost = (double)N * K / floatsPerLine * 8;
+
+    if ((double)N * M * K < STMatMulThreshold) {
+        const double fmaCost = (double)N * K * paddedM / 8;
+        return fmaCost + transposeCost + writeCCost;
+    }
+
+    /* edges are computed by 4x1, 1x3 and 1x1 blocks which are as costly as 4x3 ones */
+    const double paddedN = RoundUpPwr2(N, 4);
+    const double paddedK = (K + 2) / 3 * 3;
+    const double fmaCost = paddedN * paddedK * paddedM / 8 / 2 / numHWCores;
+    /* an OS wake up per core, a few microseconds each, mostly overlapped */
+    const double wakeUpCost = 20000.0;
+
+    return fmaCost + transposeCost / numHWCores + writeCCost + wakeUpCost;
+}
+
+/*
+ * Keeps the intermediate products of a matrix chain.
+ * Once an intermediate is consumed, its buffer is parked and handed out again
+ * for a later intermediate that fits into it, instead of going back to the heap.
+ */
+class MMChainScratch {
+public:
+    /* intermediates are allocated from the allocator current at construction */
+    MMChainScratch() : m_allocator(GetMatAllocator())
+    {
+    }
+
+    ~MMChainScratch()
+    {
+        for (auto& buffer : m_spare) {
+            m_allocator.Free(buffer.first);
         }
+    }
 
-        b1 = _mm256_load_ps(&matBT.mat[matBToffset1 + pos]);
-        b2 = _mm256_load_ps(&matBT.mat[matBToffset2 + pos]);
-        b3 = _mm256_load_ps(&matBT.mat[matBToffset3 + pos]);
+    MatAllocator& Allocator()
+    {
+        return m_allocator;
+    }
 
-        if constexpr (doL12Prefetch) {
-            if ((pos & (unsigned)15)) {
-                _mm_prefetch((const char*)&matA.mat[matAoffset2 + pos + 8],
-                             _MM_HINT_T0);
+    /* Allocate a width x height intermediate, reusing the smallest parked buffer
+     * that is large enough. */
+    const Mat Acquire(const unsigned width, const unsigned height)
+    {
+        const unsigned rowSpan = RoundUpPwr2(width, 64 / sizeof(float));
+        const size_t size = (size_t)height * rowSpan * sizeof(float);
+
+        int best = -1;
+        for (int i = 0; i < m_spare.size(); ++i) {
+            if (m_spare[i].second >= size &&
+                (best < 0 || m_spare[i].second < m_spare[best].second)) {
+                best = i;
             }
         }
 
-        a = _mm256_load_ps(&matA.mat[matAoffset1 + pos]);
-        c1 = _mm256_fmadd_ps(a, b1, c1);
-        c2 = _mm256_fmadd_ps(a, b2, c2);
-        c3 = _mm256_fmadd_ps(a, b3, c3);
-
-        if constexpr (doL12Prefetch) {
-            if ((pos & (unsigned)15)) {
-                _mm_prefetch((const char*)&matA.mat[matAoffset3 + pos + 8],
-                             _MM_HINT_T0);
-            }
+        Mat mat;
+        if (best < 0) {
+            mat = AllocMat(width, height, m_allocator);
+            m_capacity.push_back({mat.mat, size});
+            return mat;
         }
-        a = _mm256_load_ps(&matA.mat[matAoffset2 + pos]);
-        c4 = _mm256_fmadd_ps(a, b1, c4);
-        c5 = _mm256_fmadd_ps(a, b2, c5);
-        c6 = _mm256_fmadd_ps(a, b3, c6);
 
-        if constexpr (doL12Prefetch) {
-            if ((pos & (unsigned)15)) {
-                _mm_prefetch((const char*)&matA.mat[matAoffset4 + pos + 8],
-                             _MM_HINT_T0);
-            }
-        }
+        mat = {width, height, rowSpan, m_spare[best].first};
+        m_capacity.push_back(m_spare[best]);
+        m_spare.erase(m_spare.begin() + best);
+        ZeroMatPadding(mat);
 
-        a = _mm256_load_ps(&matA.mat[matAoffset3 + pos]);
-        c7 = _mm256_fmadd_ps(a, b1, c7);
-        c8 = _mm256_fmadd_ps(a, b2, c8);
-        c9 = _mm256_fmadd_ps(a, b3, c9);
+        return mat;
+    }
 
-        if constexpr (doL12Prefetch) {
-            if ((pos & (unsigned)15)) {
-                _mm_prefetch((const char*)&matBT.mat[matBToffset1 + pos + 8],
-                             _MM_HINT_T0);
-                _mm_prefetch((const char*)&matBT.mat[matBToffset2 + pos + 8],
-                             _MM_HINT_T0);
-                _mm_prefetch((const char*)&matBT.mat[matBToffset3 + pos + 8],
-                             _MM_HINT_T0);
+    /* Park the buffer of an intermediate for reuse, inputs of the chain are ignored. */
+    void Release(const Mat& mat)
+    {
+        for (int i = 0; i < m_capacity.size(); ++i) {
+            if (m_capacity[i].first == mat.mat) {
+                m_spare.push_back(m_capacity[i]);
+                m_capacity.erase(m_capacity.begin() + i);
+                return;
             }
         }
-
-        a = _mm256_load_ps(&matA.mat[matAoffset4 + pos]);
-        c10 = _mm256_fmadd_ps(a, b1, c10);
-        c11 = _mm256_fmadd_ps(a, b2, c11);
-        c12 = _mm256_fmadd_ps(a, b3, c12);
     }
 
-    /* horizontal sum */
-    memset(&accumulate[0], 0, 12 * sizeof(float));
-
-    _mm256_store_ps(&fps[0], c1);
-    _mm256_store_ps(&fps[8], c2);
-    _mm256_store_ps(&fps[16], c3);
-    _mm256_store_ps(&fps[24], c4);
-    _mm256_store_ps(&fps[32], c5);
-    _mm256_store_ps(&fps[40], c6);
-    _mm256_store_ps(&fps[48], c7);
-    _mm256_store_ps(&fps[56], c8);
-    _mm256_store_ps(&fps[64], c9);
-    _mm256_store_ps(&fps[72], c10);
-    _mm256_store_ps(&fps[80], c11);
-    _mm256_store_ps(&fps[88], c12);
-
-    for (int i = 0; i < 12; ++i) {
-        for (int j = 0; j < 8; ++j) {
-            accumulate[i] += fps[i * 8 + j];
+    /* Hand the ownership of an intermediate over to the caller. */
+    void Detach(const Mat& mat)
+    {
+        for (int i = 0; i < m_capacity.size(); ++i) {
+            if (m_capacity[i].first == mat.mat) {
+                m_capacity.erase(m_capacity.begin() + i);
+                return;
+            }
         }
     }
 
-    /* stores */
-    matData[(row + 0) * rowSpan + col + 0] = accumulate[0];
-    matData[(row + 0) * rowSpan + col + 1] = accumulate[1];
-    matData[(row + 0) * rowSpan + col + 2] = accumulate[2];
+private:
+    MatAllocator& m_allocator;
+    /* (buffer, size in bytes) of live and parked intermediates */
+    std::vector<std::pair<float*, size_t>> m_capacity;
+    std::vector<std::pair<float*, size_t>> m_spare;
+};
+
+/* Evaluate mats[i] * ... * mats[j] in the order recorded in split. */
+static const Mat MMHelper_ChainExecute(const std::vector<Mat>& mats,
+                                       const std::vector<unsigned>& split,
+                                       MMChainScratch& scratch, const unsigned i,
+                                       const unsigned j)
+{
+    if (i == j)
+        return mats[i];
+
+    const unsigned n = mats.size();
+    const unsigned s = split[i * n + j];
 
-    matData[(row + 1) * rowSpan + col + 0] = accumulate[3];
-    matData[(row + 1) * rowSpan + col + 1] = accumulate[4];
-    matData[(row + 1) * rowSpan + col + 2] = accumulate[5];
+    const Mat left = MMHelper_ChainExecute(mats, split, scratch, i, s);
+    const Mat right = MMHelper_ChainExecute(mats, split, scratch, s + 1, j);
 
-    matData[(row + 2) * rowSpan + col + 0] = accumulate[6];
-    matData[(row + 2) * rowSpan + col + 1] = accumulate[7];
-    matData[(row + 2) * rowSpan + col + 2] = accumulate[8];
+    const Mat product = scratch.Acquire(right.width, left.height);
+    MatMul(left, right, product);
 
-    matData[(row + 3) * rowSpan + col + 0] = accumulate[9];
-    matData[(row + 3) * rowSpan + col + 1] = accumulate[10];
-    matData[(row + 3) * rowSpan + col + 2] = accumulate[11];
+    scratch.Release(left);
+    scratch.Release(right);
+
+    return product;
 }
 
-/* 
- * Compute L2Y x L2X sized blocks from the output matrix C.
- * In order to keep this code nice and hot in instruction cache,
- * keep it restricted to full blocks of L2X x L2Y.
+/*
+ * Multiply a chain of matrices, mats[0] * mats[1] * ... * mats[n-1].
+ * The parenthesization is chosen by dynamic programming over MMEstimateCost,
+ * so both the shapes and the implementation each product dispatches to are accounted for.
+ * Returns the product, or an empty matrix if the chain is not multipliable.
  */
-__declspec(noalias) void MMHelper_MultL2Blocks(float* __restrict const matData,
-                                               const unsigned rowSpan, const Mat& matA,
-                                               const Mat& matBT, const unsigned col,
-                                               const unsigned row,
-                                               const unsigned L2BlockX,
-                                               const unsigned L2BlockY)
+Matrix MatMulChain(const std::vector<Mat>& mats)
 {
-    /* multiply 4x3 blocks, L2blockX == 3*k, L2blockY == 4*m */
-    for (int blockRow = row; blockRow < row + L2BlockY; blockRow += 4) {
-        for (int blockCol = col; blockCol < col + L2BlockX; blockCol += 3) {
-            MMHelper_Mult4x3Blocks(matData, rowSpan, matA, matBT, blockCol, blockRow);
+    const unsigned n = mats.size();
+
+    if (n == 0) {
+        return Matrix();
+    }
+    for (int i = 0; i + 1 < n; ++i) {
+        if (mats[i].width != mats[i + 1].height) {
+            std::cout << "Err chain dimensions!\n";
+            return Matrix();
         }
     }
-}
+    if (n == 1) {
+        return Matrix::Adopt(CopyMat(mats[0]));
+    }
 
-/* Compute K x K sized blocks from the output matrix C. see struct mmBlockInfo */
-__declspec(noalias) void MMHelper_MultFullBlocks(float* __restrict const matData,
-                                                 const unsigned rowSpan,
-                                                 const Mat& matA, const Mat& matBT,
-                                                 const unsigned colC,
-                                                 const unsigned rowC,
-                                                 const MMBlockInfo& mmBlockInfo)
-{
-    const unsigned L2BlockX = mmBlockInfo.L2BlockX, L2BlockY = mmBlockInfo.L2BlockY,
-                   L3BlockX = mmBlockInfo.L3BlockX, L3BlockY = mmBlockInfo.L3BlockY,
-                   issuedBlockSzX = mmBlockInfo.issuedBlockSzX,
-                   issuedBlockSzY = mmBlockInfo.issuedBlockSzY;
+    /* dims[i] x dims[i+1] is the shape of the ith matrix */
+    std::vector<unsigned> dims(n + 1);
+    dims[0] = mats[0].height;
+    for (int i = 0; i < n; ++i) {
+        dims[i + 1] = mats[i].width;
+    }
 
-    /* try to prefetch next bit of block into memory while still handling this one */
-    {
-        if constexpr (doL3Prefetch) {
-            std::unique_lock<std::mutex> lock(prefetchMutex);
-            int alreadyPrefetchedCol =
-              prefetched[rowC / L3BlockY][colC / issuedBlockSzX];
-            lock.unlock();
-            if (!alreadyPrefetchedCol) {
-                for (int c = colC + issuedBlockSzX; c < colC + issuedBlockSzX; ++c) {
-                    for (int pos = 0; pos < matA.rowSpan;
-                         pos += cacheLineSz / sizeof(float)) {
-                        _mm_prefetch((const char*)&matBT.mat[c * matBT.rowSpan + pos],
-                                     _MM_HINT_T2);
-                    }
+    /* cost[i*n+j] : min cost of mats[i:j], split[i*n+j] : last product is [i:s][s+1:j] */
+    std::vector<double> cost(n * n, 0.0);
+    std::vector<unsigned> split(n * n, 0);
+
+    for (int len = 2; len <= n; ++len) {
+        for (int i = 0; i + len <= n; ++i) {
+            const int j = i + len - 1;
+            cost[i * n + j] = -1;
+            for (int s = i; s < j; ++s) {
+                const double c = cost[i * n + s] + cost[(s + 1) * n + j] +
+                                 MMEstimateCost(dims[i], dims[s + 1], dims[j + 1]);
+                if (cost[i * n + j] < 0 || c < cost[i * n + j]) {
+                    cost[i * n + j] = c;
+                    split[i * n + j] = s;
                 }
-                lock.lock();
-                prefetched[rowC / L3BlockY][colC / issuedBlockSzX]++;
-                lock.unlock();
             }
         }
     }
 
-    /* multiply L2YxL2X blocks */
-    for (int blockColC = colC; blockColC < colC + issuedBlockSzX;
-         blockColC += L2BlockX) {
-        for (int blockRowC = rowC; blockRowC < rowC + issuedBlockSzY;
-             blockRowC += L2BlockY) {
-            MMHelper_MultL2Blocks(matData, rowSpan, matA, matBT, blockColC, blockRowC,
-                                  L2BlockX, L2BlockY);
-        }
-    }
+    MMChainScratch scratch;
+    const Mat product = MMHelper_ChainExecute(mats, split, scratch, 0, n - 1);
+    /* the result is handed to the caller, don't let the scratch free it */
+    scratch.Detach(product);
+
+    return Matrix::Adopt(product, scratch.Allocator());
 }
 
-/* 
- * This function divides the matrix multiplication into segments and
- * issues commands for a cache aware thread pool to handle them.
- * Uses the helper functions above. 
+/*
+ * Integer power of a square matrix, A^k, by repeated squaring.
+ * Bits of k are consumed from the most significant one: R = R*R, then R = A*R if set.
+ * The work is done in three buffers, R, its ping-pong pair and the transpose of R.
+ * Both steps multiply by the transpose of R, as powers of A commute: a squaring is
+ * R * RT, a set bit A * RT, so no transpose of A is kept.
+ * Returns the power, or an empty matrix if A is not square.
  */
-__declspec(noalias) const Mat MTMatMul(const Mat& matA, const Mat& matB)
+Matrix MatPow(const Mat& mat, const unsigned k)
 {
-    /* if CPU information is not already queried, do so */
-    if (!CPUInfoQueried) {
-        int dCaches[3];
-        int iCache;
+    if (mat.width != mat.height) {
+        std::cout << "Err power of a non-square matrix!\n";
+        return Matrix();
+    }
 
-        CPUUtil::GetCacheInfo(&dCaches[0], iCache);
+    const unsigned n = mat.width;
 
-        L2Size = dCaches[1];
-        L3Size = dCaches[2];
+    if (k == 0) {
+        Matrix I(n, n);
+        for (int row = 0; row < n; ++row) {
+            memset(&I.Data()[row * I.View().rowSpan], 0, n * sizeof(float));
+            I.Data()[row * I.View().rowSpan + row] = 1;
+        }
+        return I;
+    }
 
-        cacheLineSz = CPUUtil::GetCacheLineSize();
+    MatAllocator& allocator = GetMatAllocator();
+    Matrix R = Matrix::Adopt(CopyMat(mat, allocator), allocator);
 
-        CPUInfoQueried++;
+    /* index of the most significant set bit, it's consumed by R = A */
+    int bit = 31;
+    while (!(k & (1u << bit))) {
+        --bit;
+    }
+    if (bit == 0) {
+        return R;
     }
 
-    /* allocate the aligned float array for our new matrix C */
-    float* __restrict const matData =
-      (float*)_aligned_malloc(matA.height * matB.rowSpan * sizeof(float), AVX_ALIGN);
+    Matrix next(n, n);
+    Matrix RT(n, n);
 
-    /* construct matrix C */
-    Mat matC{matB.width, matA.height, matB.rowSpan, matData};
+    for (--bit; bit >= 0; --bit) {
+        TransposeMat(R, RT);
+        MatMulBT(R, RT, next, 0);
+        std::swap(R, next);
 
-    /* for the sake of cache, we'll be working with transposed B */
-    const Mat matBT = TransposeMat(matB);
+        if (k & (1u << bit)) {
+            TransposeMat(R, RT);
+            MatMulBT(mat, RT, next, 0);
+            std::swap(R, next);
+        }
+    }
 
-    /* initialize the HWLocalThreadPool with 1 or 2 threads per physical core
-    * for all physical cores. Number of threads per core depends on HTT status. */
-    const int HTTEnabled = CPUUtil::GetHTTStatus();
-    const int jobStride = (1 << HTTEnabled);
-    HWLocalThreadPool tp(0, jobStride);
+    return R;
+}
 
-    /* decide the block sizes for the given matrix and CPU */
-    const float invN = 1.0 / matA.rowSpan;
+/**************** Lazy matrix expressions ****************/
+
+/*
+ * Expression templates over Mat, built with operator*, operator+ and Trans().
+ * Nothing is computed until the expression is passed to MatEval:
+ *   - transposes are folded into the op flags of MatMulEx,
+ *     Trans(A * B) is evaluated as Trans(B) * Trans(A),
+ *   - sums are folded into the accumulate path, D = A*B + C*E is evaluated as
+ *     two MatMulEx calls writing into D, the second one accumulating.
+ * A temporary is allocated only for an operand of a product that is not a plain
+ * matrix, e.g. (A*B)*C, or when the destination is also read by the expression.
+ * Expressions keep pointers to their matrices, evaluate them before those go away.
+ */
 
-    int QL2 = invN * L2Size / sizeof(float);
-    int QL3 = invN * L3Size / sizeof(float);
-    int k = min(max(QL2 / 6, 1), 10);
-    int m = min(max(QL2 / 8, 1), 10);
-    int L2BlockX = 3 * k;
-    int L2BlockY = 4 * m;
-    int lcmMN = std::lcm(k, m);
-    int L3BlockX = min(max(QL3 / 120 / lcmMN * lcmMN * 60, 12*L2BlockX), 360);
-    int L3BlockY = L3BlockX;
-    int issuedBlockSzX = L3BlockX / 4;
-    int issuedBlockSzY = L3BlockY / 3;
+/* Leaf of an expression, a matrix or its transpose */
+struct MMTermExpr {
+    const Mat* mat;
+    int trans;
 
-    /*printf("%d %d\n%d %d %d %d %d %d\n", matC.height, matC.width, L2BlockX, L2BlockY, issuedBlockSzX, issuedBlockSzY,
-           L3BlockX, L3BlockY);*/
+    unsigned Width() const
+    {
+        return trans ? mat->height : mat->width;
+    }
+    unsigned Height() const
+    {
+        return trans ? mat->width : mat->height;
+    }
+    int Reads(const float* data) const
+    {
+        return mat->mat == data;
+    }
+};
 
-    MMBlockInfo mmBlockInfo{L3BlockX, L3BlockY,       L2BlockX,
-                            L2BlockY, issuedBlockSzX, issuedBlockSzY};
+/* Product of two expressions, or the transpose of it */
+template <typename L, typename R> struct MMProdExpr {
+    L lhs;
+    R rhs;
+    int trans;
 
-    /* before we begin, start prefetching the first L3 level block */
-    /* reset the prefetched flags */
-    memset(&prefetched[0][0], 0, 1024 * 1024 * sizeof(int));
-    /* prefetch rows of A and columns of B, one cache line at a time */
-    for (int r = 0; r < L3BlockY; ++r) {
-        for (int pos = 0; pos < matA.rowSpan; pos += cacheLineSz / sizeof(float)) {
-            _mm_prefetch((const char*)&matA.mat[r * matA.rowSpan + pos], _MM_HINT_T2);
-        }
+    unsigned Width() const
+    {
+        return trans ? lhs.Height() : rhs.Width();
     }
-    for (int c = 0; c < L3BlockX; ++c) {
-        for (int pos = 0; pos < matA.rowSpan; pos += cacheLineSz / sizeof(float)) {
-            _mm_prefetch((const char*)&matBT.mat[c * matBT.rowSpan + pos], _MM_HINT_T2);
-        }
+    unsigned Height() const
+    {
+        return trans ? rhs.Width() : lhs.Height();
     }
-    /* prefetch is called for the first block, mark it. */
-    prefetched[0][0]++;
+    int Reads(const float* data) const
+    {
+        return lhs.Reads(data) || rhs.Reads(data);
+    }
+};
 
-    /* start issuing jobs for the thread pool */
+/* Sum of two expressions */
+template <typename L, typename R> struct MMSumExpr {
+    L lhs;
+    R rhs;
 
-    /*
-     * We incorporate multiple levels of tiling into our traversal.
-     *
-     * If we issue commands linearly, we'll have poor L3 cache utilization.
-     * [ [C0T0 | C0T1] [C1T0 | C1T1] ... [C5T0 | C5T1] ] covering a rows, b columns,
-     * (a+b)N floats of data is needed to compute a*b sized block.
-     * So, instead, we issue commands in the blocked manner, like:
-     * [ [C0T0 | C0T1] [C1T0 | C1T1] 
-     *   [C2T0 | C5T1] [C2T0 | C2T1] ] 
-     *
-     * Traverse L3 sized blocks, 
-     * inside each, issue issuedBlockSz sized blocks.
-     */
+    unsigned Width() const
+    {
+        return lhs.Width();
+    }
+    unsigned Height() const
+    {
+        return lhs.Height();
+    }
+    int Reads(const float* data) const
+    {
+        return lhs.Reads(data) || rhs.Reads(data);
+    }
+};
 
-    int rowC = 0;
-    /* handle L3Y sized rows
-     * cast unsigned dimensions to signed to avoid UB */
-    for (; rowC <= (int)matA.height - L3BlockY; rowC += L3BlockY) {
-        int colC = 0;
-        /* handle L3Y x L3X sized blocks */
-        for (; colC <= (int)matB.width - L3BlockX; colC += L3BlockX) {
-            /* Issue issuedBlockSzY x issuedBlockSzX sized blocks */
-            for (int blockRowC = rowC; blockRowC < rowC + L3BlockY;
-                 blockRowC += issuedBlockSzY) {
-                for (int blockColC = colC; blockColC < colC + L3BlockX;
-                     blockColC += jobStride * issuedBlockSzX) {
-                    tp.Add({
-                        HWLocalThreadPool::WrapFunc(MMHelper_MultFullBlocks, matData,
-                                                    matB.rowSpan, matA, matBT, blockColC,
-                                                    blockRowC, mmBlockInfo),
-                        HWLocalThreadPool::WrapFunc(MMHelper_MultFullBlocks, matData, 
-                                                    matB.rowSpan, matA, matBT,
-                                                    blockColC + issuedBlockSzX, 
-                                                    blockRowC, mmBlockInfo)
-                        });
-                }
+template <typename T> struct IsMMExpr : std::false_type {};
+template <> struct IsMMExpr<MMTermExpr> : std::true_type {};
+template <typename L, typename R> struct IsMMExpr<MMProdExpr<L, R>> : std::true_type {};
+template <typename L, typename R> struct IsMMExpr<MMSumExpr<L, R>> : std::true_type {};
+
+/* Mat, Matrix or an expression, the types the operators below accept */
+template <typename T>
+using MMOperand = std::enable_if_t<std::is_same<T, Mat>::value ||
+                                     std::is_same<T, Matrix>::value || IsMMExpr<T>::value,
+                                   int>;
+
+inline MMTermExpr MMAsExpr(const Mat& mat)
+{
+    return {&mat, 0};
+}
+inline MMTermExpr MMAsExpr(const Matrix& mat)
+{
+    return {&mat.View(), 0};
+}
+template <typename E, std::enable_if_t<IsMMExpr<E>::value, int> = 0>
+inline const E& MMAsExpr(const E& expr)
+{
+    return expr;
+}
+
+inline MMTermExpr Trans(const Mat& mat)
+{
+    return {&mat, 1};
+}
+inline MMTermExpr Trans(const Matrix& mat)
+{
+    return {&mat.View(), 1};
+}
+inline MMTermExpr Trans(const MMTermExpr& expr)
+{
+    return {expr.mat, !expr.trans};
+}
+template <typename L, typename R> MMProdExpr<L, R> Trans(const MMProdExpr<L, R>& expr)
+{
+    return {expr.lhs, expr.rhs, !expr.trans};
+}
+template <typename L, typename R> auto Trans(const MMSumExpr<L, R>& expr)
+{
+    return MMSumExpr<decltype(Trans(expr.lhs)), decltype(Trans(expr.rhs))>{
+      Trans(expr.lhs), Trans(expr.rhs)};
+}
+
+template <typename L, typename R, MMOperand<L> = 0, MMOperand<R> = 0>
+auto operator*(const L& lhs, const R& rhs)
+{
+    using LE = std::decay_t<decltype(MMAsExpr(lhs))>;
+    using RE = std::decay_t<decltype(MMAsExpr(rhs))>;
+    return MMProdExpr<LE, RE>{MMAsExpr(lhs), MMAsExpr(rhs), 0};
+}
+
+template <typename L, typename R, MMOperand<L> = 0, MMOperand<R> = 0>
+auto operator+(const L& lhs, const R& rhs)
+{
+    using LE = std::decay_t<decltype(MMAsExpr(lhs))>;
+    using RE = std::decay_t<decltype(MMAsExpr(rhs))>;
+    return MMSumExpr<LE, RE>{MMAsExpr(lhs), MMAsExpr(rhs)};
+}
+
+/* Copy (or add if addToC is set) a matrix or its transpose into dst. */
+static void MMHelper_EvalInto(const MMTermExpr& expr, const Mat& dst, const int addToC)
+{
+    const Mat& src = *expr.mat;
+    /* element-wise, bands of dst rows in chunks of about 256KB */
+    ParallelFor(0, dst.height, [&](const unsigned begin, const unsigned end) {
+        for (int row = begin; row < end; ++row) {
+            for (int col = 0; col < dst.width; ++col) {
+                const float val = expr.trans ? src.mat[col * src.rowSpan + row]
+                                             : src.mat[row * src.rowSpan + col];
+                dst.mat[row * dst.rowSpan + col] =
+                  addToC ? dst.mat[row * dst.rowSpan + col] + val : val;
             }
         }
-        /* handle the block w < L3X, h = L3Y at the end of the row */
-        if (matB.width > colC) {
-            const unsigned remSubX = (matB.width - colC) >> HTTEnabled;
-            tp.Add({
-                HWLocalThreadPool::WrapFunc(MMHelper_MultAnyBlocks, matData,
-                                            matB.rowSpan, matA, matBT, colC, rowC,
-                                            remSubX, L3BlockY, mmBlockInfo),
-                HWLocalThreadPool::WrapFunc(MMHelper_MultAnyBlocks, matData, 
-                                            matB.rowSpan, matA, matBT,
-                                            colC + remSubX, rowC, 
-                                            matB.width - colC - remSubX, L3BlockY,
-                                            mmBlockInfo)
-                });
-        }
-    }
-    /* handle last row, h < L3Y */
-    int colC = 0;
-    /* first handle blocks of w = L3X, h < L3Y */
-    for (; colC <= (int)matB.width - L3BlockX; colC += jobStride * issuedBlockSzX) {
-        tp.Add({
-            HWLocalThreadPool::WrapFunc(MMHelper_MultAnyBlocks, matData, 
-                                        matB.rowSpan, matA, matBT, colC,
-                                        rowC, issuedBlockSzX, matA.height - rowC, 
-                                        mmBlockInfo),
-            HWLocalThreadPool::WrapFunc(MMHelper_MultAnyBlocks, matData,
-                                        matB.rowSpan, matA, matBT,
-                                        colC + issuedBlockSzX, rowC, issuedBlockSzX,
-                                        matA.height - rowC, mmBlockInfo)});
-    }
-    /* now handle the rightmost block of w < L3X, h < L3Y */
-    tp.Add({HWLocalThreadPool::WrapFunc(MMHelper_MultAnyBlocks, matData, matB.rowSpan,
-                                        matA, matBT, colC, rowC, matB.width - colC,
-                                        matA.height - rowC, mmBlockInfo),
-        []() {}});
+    }, MM_SCHEDULE_DYNAMIC, max(65536u / dst.rowSpan, 1u));
+}
 
-    /* -- commands issued -- */
+template <typename L, typename R>
+static void MMHelper_EvalInto(const MMSumExpr<L, R>& expr, const Mat& dst,
+                              const int addToC)
+{
+    assert(expr.lhs.Width() == expr.rhs.Width() &&
+           expr.lhs.Height() == expr.rhs.Height());
+    MMHelper_EvalInto(expr.lhs, dst, addToC);
+    MMHelper_EvalInto(expr.rhs, dst, 1);
+}
 
-    /* wait for the thread pool to finish */
-    tp.Close();
-    /* free the temporary bT matrix */
-    _aligned_free(matBT.mat);
+/* Operands of a product that are plain matrices are used directly,
+ * others are evaluated into the given temporary. */
+static MMTermExpr MMHelper_AsTerm(const MMTermExpr& expr, Matrix& temp)
+{
+    return expr;
+}
+template <typename E> static MMTermExpr MMHelper_AsTerm(const E& expr, Matrix& temp)
+{
+    temp = Matrix(expr.Width(), expr.Height());
+    MMHelper_EvalInto(expr, temp, 0);
+    return {&temp.View(), 0};
+}
 
-    return matC;
+template <typename L, typename R>
+static void MMHelper_EvalInto(const MMProdExpr<L, R>& expr, const Mat& dst,
+                              const int addToC)
+{
+    Matrix lhsTemp, rhsTemp;
+    const MMTermExpr lhs = MMHelper_AsTerm(expr.lhs, lhsTemp);
+    const MMTermExpr rhs = MMHelper_AsTerm(expr.rhs, rhsTemp);
+
+    assert(lhs.Width() == rhs.Height());
+
+    /* (L * R)^T == R^T * L^T */
+    const MMTermExpr a = expr.trans ? Trans(rhs) : lhs;
+    const MMTermExpr b = expr.trans ? Trans(lhs) : rhs;
+
+    const unsigned flags = (a.trans ? MM_TRANS_A : 0) | (b.trans ? MM_TRANS_B : 0) |
+                           (addToC ? MM_ACCUMULATE : 0);
+    MatMulEx(*a.mat, *b.mat, dst, flags);
 }
 
-/* MatMul function, a simple branch that calls the proper implementation
- * based on the complexity of the input matrix. */
-const Mat MatMul(const Mat& matA, const Mat& matB)
+/* Evaluate the expression into dst, dst += expr if addToDst is set. */
+template <typename E, std::enable_if_t<IsMMExpr<E>::value, int> = 0>
+void MatEval(const E& expr, const Mat& dst, const int addToDst = 0)
 {
-    /* 
-     * If complexity is low enough,
-     * use the single threaded, transposed B method.
-     * A(N, M) B(M, K) => # of ops ~= 2*N*K*M 
-     */
-    if (matA.height * matA.width * matB.width < 350 * 350 * 350) {
-        return ST_TransposedBMatMul(matA, matB);
+    assert(expr.Width() == dst.width && expr.Height() == dst.height);
+
+    /* the destination is overwritten while the expression is evaluated */
+    if (expr.Reads(dst.mat)) {
+        const Matrix temp(dst.width, dst.height);
+        MMHelper_EvalInto(expr, temp, 0);
+        MMHelper_EvalInto(MMAsExpr(temp), dst, addToDst);
+        return;
     }
-    return MTMatMul(matA, matB);
+
+    MMHelper_EvalInto(expr, dst, addToDst);
+}
+
+/* Evaluate the expression into a newly allocated matrix. */
+template <typename E, std::enable_if_t<IsMMExpr<E>::value, int> = 0>
+Matrix MatEval(const E& expr)
+{
+    Matrix dst(expr.Width(), expr.Height());
+    MMHelper_EvalInto(expr, dst, 0);
+    return dst;
 }
 
+/************** ~~Lazy matrix expressions~~ **************/
+
+/* MM_NO_MAIN leaves the demo out, s.t the benchmarks can include this file */
+#ifndef MM_NO_MAIN
 int __cdecl main(int argc, char* argv[])
 {
     if (argc < 4) {
@@ -1036,6 +3285,29 @@ int __cdecl main(int argc, char* argv[])
     /* make sure the runtime system supports AVX and FMA ISAs */
     assert(CPUUtil::GetSIMDSupport());
 
+    /* more than two inputs are multiplied as a chain, the last argument is the output */
+    if (argc > 4) {
+        std::vector<Matrix> inputs;
+        std::vector<Mat> chain;
+        for (int i = 1; i < argc - 1; ++i) {
+            inputs.push_back(LoadMat(argv[i]));
+            chain.push_back(inputs.back());
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        const Matrix outMtx = MatMulChain(chain);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        std::cout
+          << "Matrix Chain Multiplication: "
+          << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+          << " microseconds.\n";
+
+        DumpMat(argv[argc - 1], outMtx);
+
+        return 0;
+    }
+
     const char* inputMtxAFile = argv[1];
     const char* inputMtxBFile = argv[2];
     const char* outMtxABFile = argv[3];
@@ -1044,26 +3316,27 @@ int __cdecl main(int argc, char* argv[])
     //const char* inputMtxBFile = "matrixBx.bin";
     //const char* outMtxABFile = "matrixAB-out.bin";
 
-    const Mat inputMtxA = LoadMat(inputMtxAFile);
-    const Mat inputMtxB = LoadMat(inputMtxBFile);
+    const Matrix inputMtxA = LoadMat(inputMtxAFile);
+    const Matrix inputMtxB = LoadMat(inputMtxBFile);
 
     /*printf("%d %d %d %d\n", inputMtxA.height, inputMtxA.width, inputMtxB.height,
            inputMtxB.width);*/
 
     auto start = std::chrono::high_resolution_clock::now();
-    const Mat outMtxAB = MatMul(inputMtxA, inputMtxB);
+    const Matrix outMtxAB = MatMul(inputMtxA, inputMtxB);
     auto end = std::chrono::high_resolution_clock::now();
 
     std::cout
       << "Matrix Multiplication: "
       << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
       << " microseconds.\n";
+    std::cout << "Large pages: "
+              << (GetMatBufferPool().IsLargePage(outMtxAB.Data()) ? "yes" : "no") << "\n";
+    printf("First touch: %.0f, transpose: %.0f, multiply: %.0f microseconds.\n",
+           mmPhaseTimes.firstTouch, mmPhaseTimes.transpose, mmPhaseTimes.multiply);
 
     DumpMat(outMtxABFile, outMtxAB);
 
-    FreeMat(inputMtxA);
-    FreeMat(inputMtxB);
-    FreeMat(outMtxAB);
-
     return 0;
 }
+#endif
@@ -0,0 +1,141 @@
+#pragma once
+#include <functional>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <cassert>
+#include "ThreadPool.h"
+
+/*
+ * Graph of dependent jobs executed on a HWLocalThreadPool
+ *
+ * Each task is a job as in HWLocalThreadPool::Add (one function per thread of the core)
+ * and the ids of the tasks it depends on, which have to be added before it, s.t the
+ * graph has no cycles. Run() queues the tasks without dependencies, a task is queued
+ * as soon as the last of its predecessors finishes, instead of after a barrier that
+ * waits for a whole phase (e.g pack -> multiply -> epilogue, panel -> trailing update).
+ *
+ * Locality:
+ *   By default a task is queued to the core group (L3 domain) of the core that
+ *     finished its last predecessor, s.t it reads that predecessor's output from the
+ *     same L3. Cores of other groups still steal it when they would idle otherwise.
+ *   An explicit group pins the task's queue instead, as with Add.
+ *
+ * The graph can be run any number of times, not concurrently with itself. Run() may
+ *   be called from a job of the pool, the calling thread runs queued tasks meanwhile.
+ */
+class HWLocalTaskGraph {
+public:
+    typedef unsigned TaskId;
+
+    /* Group hint of AddTask: the group of the core finishing the last predecessor */
+    static constexpr int PRODUCER_GROUP = -1;
+
+    HWLocalTaskGraph(HWLocalThreadPool& pool, const unsigned partition = 0,
+                     const int priority = HWLocalThreadPool::PRIORITY_NORMAL)
+        : m_pool(pool), m_partition(partition), m_priority(priority)
+    {
+    }
+
+    HWLocalTaskGraph(const HWLocalTaskGraph&) = delete;
+    HWLocalTaskGraph& operator=(const HWLocalTaskGraph&) = delete;
+
+    /* Add a task running job once every task in deps is finished, returns its id */
+    TaskId AddTask(std::vector<std::function<void()>> const& job,
+                   std::vector<TaskId> const& deps = {},
+                   const int group = PRODUCER_GROUP)
+    {
+        const TaskId id = m_tasks.size();
+        assert(!job.empty() && job.size() <= m_pool.NumThreadsPerCore());
+
+        Task task;
+        task.job = job;
+        /* pad to the threads of a core, the missing threads idle */
+        task.job.resize(m_pool.NumThreadsPerCore(), []() {});
+        task.numDeps = deps.size();
+        task.group = group;
+        m_tasks.push_back(std::move(task));
+
+        for (const TaskId dep : deps) {
+            assert(dep < id);
+            m_tasks[dep].successors.push_back(id);
+        }
+        return id;
+    }
+
+    const unsigned NumTasks()
+    {
+        return m_tasks.size();
+    }
+
+    /* Run every task of the graph and wait for them */
+    void Run()
+    {
+        const unsigned numTasks = m_tasks.size();
+        m_pendingDeps.reset(new std::atomic<unsigned>[numTasks]);
+        m_pendingFuncs.reset(new std::atomic<unsigned>[numTasks]);
+        for (unsigned i = 0; i < numTasks; ++i) {
+            m_pendingDeps[i] = m_tasks[i].numDeps;
+        }
+
+        /* roots have no producer, they're spread over the groups */
+        unsigned nextGroup = 0;
+        for (unsigned i = 0; i < numTasks; ++i) {
+            if (m_tasks[i].numDeps == 0)
+                Release(i, nextGroup++);
+        }
+
+        /* released tasks join the batch before their predecessor's job is done, the
+        calling thread claims them as they're released too */
+        m_pool.WaitBatch(m_batch);
+    }
+
+private:
+    typedef struct Task {
+        std::vector<std::function<void()>> job;
+        std::vector<TaskId> successors;
+        unsigned numDeps;
+        int group;
+    } Task;
+
+    /* Queue a task whose dependencies are finished, to producerGroup unless it has
+    an explicit group */
+    void Release(const TaskId id, const unsigned producerGroup)
+    {
+        const Task& task = m_tasks[id];
+        m_pendingFuncs[id] = task.job.size();
+
+        /* the last function of the task to return finishes it */
+        std::vector<std::function<void()>> job;
+        for (const auto& func : task.job) {
+            job.push_back([this, id, &func]() {
+                func();
+                if (--m_pendingFuncs[id] == 0)
+                    Finish(id);
+            });
+        }
+        m_pool.Add(job, task.group >= 0 ? task.group : producerGroup, &m_batch,
+                   m_partition, m_priority);
+    }
+
+    /* Release the successors of a task that became ready */
+    void Finish(const TaskId id)
+    {
+        const int core = m_pool.CurrentCoreHandler();
+        const unsigned group = core >= 0 ? m_pool.GroupOfCore(core) : 0;
+        for (const TaskId next : m_tasks[id].successors) {
+            if (--m_pendingDeps[next] == 0)
+                Release(next, group);
+        }
+    }
+
+    HWLocalThreadPool& m_pool;
+    const unsigned m_partition;
+    const int m_priority;
+    std::vector<Task> m_tasks;
+
+    /* state of a run */
+    HWLocalThreadPool::JobBatch m_batch;
+    std::unique_ptr<std::atomic<unsigned>[]> m_pendingDeps;
+    std::unique_ptr<std::atomic<unsigned>[]> m_pendingFuncs;
+};
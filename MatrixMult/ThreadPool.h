@@ -1,7 +1,8 @@
 #pragma once
 #include <functional>
 #include <thread>
-#include <queue>
+#include <deque>
+#include <condition_variable>
 #include <mutex>
 #include <tuple>
 #include <vector>
@@ -9,7 +10,13 @@
 #include <cmath>
 #include <future>
 #include <array>
+#include <atomic>
+#include <memory>
+#include <string>
 #include <cassert>
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
 #include "CPUUtil.h"
 
 /*
@@ -35,22 +42,58 @@
  *       and mapping between physical and logical processors.
  *
  *   HWLocalThreadPool:
+ *     Uses the cores in the process affinity mask only, e.g. the cpuset of a container.
  *     Submission:
  *       initializer list or vector of (void function (void)) of length N
  *         where N is the num of threads that will spawn on the same core,
  *         and, the length of the std::function array. 
  *         ith thread handles repective ith function
+ *       AddHelped(work, helper) runs work on one thread of the core only,
+ *         the rest run helper next to it until work is done (SMT helper threads).
+ *       Each job goes to the queue of a core group, the cores sharing one L3 instance
+ *         (CCX on AMD Zen, sub-NUMA cluster on Xeon). Jobs of the same group should
+ *         work on the same data s.t it's loaded into a single L3.
+ *       Partitions: AddPartition(name, n) moves n cores into a new partition with
+ *         queues of its own, jobs added to a partition only run on its cores.
+ *         Partition 0 holds the rest of the cores, e.g to reserve cores for small
+ *         latency critical jobs while long ones run on the rest.
+ *       Jobs can be added to a JobBatch, WaitBatch(batch) runs the queued jobs of the
+ *         batch on the calling thread too, until all of them are handled.
+ *       Jobs are queued in 3 priority classes, higher classes are taken first.
+ *       Jobs may add jobs and wait for them: WaitBatch never waits for a queued job,
+ *         it runs them, so a worker waiting on its own batch can't deadlock the pool.
+ *         IsWorkerThread() tells whether the caller is a thread of the pool.
+ *       Dependent jobs: HWLocalTaskGraph (TaskGraph.h) releases tasks to the pool as
+ *         their predecessors finish, on the L3 group of the core of the predecessor.
+ *       With C++20 coroutines, co_await pool.Schedule() continues the coroutine as
+ *         a job of the pool instead of blocking a thread, see PoolTask.
+ *       Wait() blocks until every submitted job is handled, the pool can be reused,
+ *       Close() finishes (or drops) the queued jobs and terminates the pool.
  *     
  *     Core Handlers:
  *       We create NumHWCores many CoreHandler objects.
  *       These objects are responsible for managing their cores.
- *       They check the main pool for jobs, when a job is found,
+ *       They check their group's queue of their partition for jobs, then the other
+ *       groups' queues s.t no core idles while there's work left, when a job is found,
  *           if N==1   ,   they call the only function in the job description.
  *           if N>1    ,   they assign N-1 threads on the same physical core to,
  *                         respective functions in the array. The CoreHandler is 
  *                         assigned to the first function.
+ *       Cores with fewer logical processors than the pool's threads per core
+ *         (efficiency cores of hybrid CPUs have no HT) run the extra functions
+ *         of a job themselves, one after another.
+ *       Efficiency cores leave the last jobs in the queues to idle performance cores,
+ *         s.t a slow core doesn't finish the last job long after the others are idle.
  *       Once CoreHandler finishes its own task, it waits for other threads,
  *       Then its available for new jobs, waiting to be notified by the pool manager.
+ *
+ *     Queues:
+ *       Each queue is a bounded lock free ring buffer per priority class, cores pop
+ *         jobs without taking a lock. A full ring spills to a locked list.
+ *       Idle cores sleep on an event count of their partition, they take its key
+ *         before the last look at the queues, s.t a job added meanwhile wakes them.
+ *       WaitBatch claims the queued jobs of its batch from a list kept in the batch,
+ *         a job claimed there is skipped by the core popping it from the ring.
  *     
  *     Thread Handlers:
  *       Responsible for handling tasks handed away by the CoreHandler.
@@ -70,10 +113,37 @@
  */
 
 class HWLocalThreadPool {
+protected:
+    struct PoolJob;
+
 public:
-    HWLocalThreadPool(int _numOfCoresToUse, int _numThreadsPerCore) : m_terminate(false)
+    /* Priority classes of jobs, cores take the queued jobs of the highest class first
+    and FIFO inside a class. Running jobs aren't preempted, the multiplications issue
+    their block jobs a few at a time instead, s.t urgent jobs only wait for a block. */
+    enum JobPriority { PRIORITY_LOW = 0, PRIORITY_NORMAL = 1, PRIORITY_HIGH = 2 };
+    static constexpr int NUM_PRIORITIES = 3;
+
+    /* Jobs added with the same batch are waited for together, see WaitBatch */
+    struct JobBatch {
+        unsigned numPending = 0;
+        /* jobs of the batch in the queues, WaitBatch claims them from here.
+        Guarded by the pool's m_doneMutex */
+        std::deque<std::shared_ptr<PoolJob>> queued;
+        /* threads in WaitBatch, woken when a job is added to the batch or when
+        numPending reaches wakeAt, the highest maxPending they wait for. Guarded by the
+        pool's m_doneMutex too */
+        unsigned numWaiters = 0, wakeAt = 0;
+        std::condition_variable waiters;
+    };
+
+    HWLocalThreadPool(int _numOfCoresToUse, int _numThreadsPerCore)
+        : m_terminate(false), m_waitToFinish(false)
     {
-        m_numHWCores = CPUUtil::GetNumHWCores();
+        /* only the cores the process may run on, e.g. the cpuset of a container */
+        m_numHWCores = CPUUtil::GetNumAvailableHWCores();
+        DWORD_PTR processMask, systemMask;
+        if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+            processMask = ~(DWORD_PTR)0;
 
         if (_numOfCoresToUse <= 0) {
             m_numCoreHandlers = m_numHWCores;
@@ -88,20 +158,38 @@ public:
             m_numThreadsPerCore = _numThreadsPerCore;
         }
 
+        /* one queue per L3 domain, all cores start in partition 0. Every partition
+        has a core, their slots are allocated upfront s.t cores never see them move */
+        const int numL3Domains = CPUUtil::GetNumL3Domains();
+        m_numGroups = numL3Domains > 0 ? numL3Domains : 1;
+        m_partitions.reset(new Partition[m_numCoreHandlers]);
+        m_partitions[0].numCores = m_numCoreHandlers;
+        m_partitions[0].queues.reset(new Queue<std::shared_ptr<PoolJob>>[m_numGroups]);
+        m_numPartitions = 1;
+
         /* malloc m_coreHandlers s.t no default initialization takes place, 
         we construct every object with placement new */
         m_coreHandlers = (CoreHandler*)malloc(m_numCoreHandlers * sizeof(CoreHandler));
         m_coreHandlerThreads = new std::thread[m_numCoreHandlers];
 
         for (int i = 0; i < m_numCoreHandlers; ++i) {
+            /* handlers beyond the available cores share them */
+            const int hwCore = CPUUtil::GetAvailableHWCore(i % m_numHWCores);
             ULONG_PTR processAffinityMask;
-            int maskQueryRetCode = CPUUtil::GetProcessorMask(i, processAffinityMask);
+            int maskQueryRetCode =
+              CPUUtil::GetProcessorMask(hwCore, processAffinityMask);
             if (maskQueryRetCode) {
                 assert(0, "Can't query processor relations.");
                 return;
             }
-            CoreHandler* coreHandler =
-              new (&m_coreHandlers[i]) CoreHandler(this, i, processAffinityMask);
+            processAffinityMask &= processMask;
+            const int group = CPUUtil::GetCoreL3Domain(hwCore);
+            const int efficiency =
+              CPUUtil::GetCoreType(hwCore) == CPUUtil::CORE_TYPE_EFFICIENCY;
+            m_partitions[0].numPerformanceCores += !efficiency;
+            CoreHandler* coreHandler = new (&m_coreHandlers[i])
+              CoreHandler(this, i, hwCore, processAffinityMask, group > 0 ? group : 0,
+                          efficiency);
             m_coreHandlerThreads[i] = std::thread(std::ref(m_coreHandlers[i]));
         }
     }
@@ -112,21 +200,206 @@ public:
             Close();
     }
 
-    void Add(std::vector<std::function<void()>> const& F)
+    /* Add a job to the queue of the given core group (see GroupOfCore) of the given
+    partition in the given priority class, and to batch */
+    void Add(std::vector<std::function<void()>> const& F, const unsigned group = 0,
+             JobBatch* const batch = NULL, const unsigned partition = 0,
+             const int priority = PRIORITY_NORMAL)
+    {
+        const unsigned target = partition < m_numPartitions ? partition : 0;
+        assert(!F.empty());
+        auto job = std::make_shared<PoolJob>();
+        job->funcs = F;
+        /* pad to the threads of the core, every child thread takes a function */
+        if (job->funcs.size() < m_numThreadsPerCore)
+            job->funcs.resize(m_numThreadsPerCore, []() {});
+        job->batch = batch;
+        job->partition = target;
+        job->group = group;
+        job->priority = priority;
+        /* counted before it's visible, whoever claims it never sees a negative count */
+        Partition& queues = m_partitions[target];
+        ++queues.numQueued;
+        {
+            std::unique_lock<std::mutex> lock(m_doneMutex);
+            ++m_numPendingJobs;
+            if (batch) {
+                ++batch->numPending;
+                batch->queued.push_back(job);
+                /* a thread waiting for the batch may claim it, e.g a successor of a
+                task graph job that a core released while the waiter slept */
+                if (batch->numWaiters > 0)
+                    batch->waiters.notify_one();
+            }
+        }
+        queues.queues[group % m_numGroups].Push(std::move(job), priority);
+        WakeCore(target);
+    }
+
+    /* Helper thread mode: the core handler runs work alone, the other threads of the
+    core run helper, e.g to prefetch into the shared caches for it. done is set once
+    work returns, helper has to return when it sees it. */
+    void AddHelped(std::function<void()> const& work,
+                   std::function<void(const std::atomic<int>&)> const& helper,
+                   const unsigned group = 0, JobBatch* const batch = NULL,
+                   const unsigned partition = 0, const int priority = PRIORITY_NORMAL)
+    {
+        auto done = std::make_shared<std::atomic<int>>(0);
+        std::vector<std::function<void()>> job;
+        job.push_back([work, done]() {
+            work();
+            done->store(1);
+        });
+        for (int i = 1; i < m_numThreadsPerCore; ++i) {
+            job.push_back([helper, done]() { helper(*done); });
+        }
+        Add(job, group, batch, partition, priority);
+    }
+
+#ifdef __cpp_impl_coroutine
+    /* Queue the resumption of a suspended coroutine as a job, on the core handler
+    thread, the other threads of the core idle */
+    void AddResume(const std::coroutine_handle<> handle, const unsigned group = 0,
+                   const unsigned partition = 0, const int priority = PRIORITY_NORMAL)
+    {
+        std::vector<std::function<void()>> job(m_numThreadsPerCore, []() {});
+        job[0] = [handle]() { handle.resume(); };
+        Add(job, group, NULL, partition, priority);
+    }
+
+    /* Awaitable of Schedule */
+    struct ScheduleAwaitable {
+        HWLocalThreadPool* pool;
+        unsigned group, partition;
+        int priority;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+        void await_suspend(const std::coroutine_handle<> handle) const
+        {
+            pool->AddResume(handle, group, partition, priority);
+        }
+        void await_resume() const noexcept {}
+    };
+
+    /* co_await pool.Schedule(...) suspends the calling coroutine and continues it as a
+    job of the given group, partition and priority class, no thread blocks meanwhile */
+    ScheduleAwaitable Schedule(const unsigned group = 0, const unsigned partition = 0,
+                               const int priority = PRIORITY_NORMAL)
+    {
+        return {this, group, partition, priority};
+    }
+#endif
+
+    /* Block until every job added so far is handled. Unlike Close(),
+    the pool stays alive and can be given new jobs afterwards. */
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(m_doneMutex);
+        while (m_numPendingJobs > 0) {
+            m_jobsDoneNotifier.wait(lock);
+        }
+    }
+
+    /* Block until at most maxPending jobs of batch are left, every job by default.
+    Instead of idling, the calling thread runs the batch's queued jobs itself meanwhile,
+    all functions of a job in order. With maxPending > 0 this lets a submitter keep
+    only a window of jobs queued, see PRIORITY_HIGH. */
+    void WaitBatch(JobBatch& batch, const unsigned maxPending = 0)
+    {
+        while (1) {
+            std::shared_ptr<PoolJob> job;
+            {
+                std::unique_lock<std::mutex> lock(m_doneMutex);
+                while (1) {
+                    if (batch.numPending <= maxPending) {
+                        /* what's left was claimed by the cores */
+                        if (batch.numPending == 0)
+                            batch.queued.clear();
+                        return;
+                    }
+                    while (!job && !batch.queued.empty()) {
+                        if (Claim(*batch.queued.front()))
+                            job = batch.queued.front();
+                        batch.queued.pop_front();
+                    }
+                    if (job)
+                        break;
+                    /* the rest of the batch is running on the cores, jobs they add
+                    to it meanwhile wake us up too, no core might take them (e.g an
+                    efficiency core leaving them to a performance core about to wait
+                    for jobs) */
+                    ++batch.numWaiters;
+                    batch.wakeAt = max(batch.wakeAt, maxPending);
+                    batch.waiters.wait(lock);
+                    if (--batch.numWaiters == 0)
+                        batch.wakeAt = 0;
+                }
+            }
+            const unsigned numFuncs =
+              min((unsigned)job->funcs.size(), m_numThreadsPerCore);
+            for (unsigned i = 0; i < numFuncs; ++i) {
+                job->funcs[i]();
+            }
+            JobDone(job->batch);
+        }
+    }
+
+    /* Move numCores cores of partition 0, the last ones, into a new partition.
+    Returns its index, jobs already queued in partition 0 aren't moved. */
+    unsigned AddPartition(const std::string& name, const unsigned numCores)
     {
-        m_queue.Push(F);
-        m_queueToCoreNotifier.notify_one();
+        std::unique_lock<std::mutex> lock(m_partitionMutex);
+        /* partition 0 keeps at least a core */
+        assert(numCores > 0 && numCores < m_partitions[0].numCores);
+
+        /* set up the partition before the cores can see it */
+        const unsigned partition = m_numPartitions;
+        Partition& added = m_partitions[partition];
+        added.name = name;
+        added.queues.reset(new Queue<std::shared_ptr<PoolJob>>[m_numGroups]);
+        m_numPartitions = partition + 1;
+
+        for (int i = m_numCoreHandlers - 1; i >= 0 && added.numCores < numCores; --i) {
+            CoreHandler& core = m_coreHandlers[i];
+            if (core.m_partition != 0)
+                continue;
+            core.m_partition = partition;
+            --m_partitions[0].numCores;
+            ++added.numCores;
+            m_partitions[0].numPerformanceCores -= !core.m_efficiency;
+            added.numPerformanceCores += !core.m_efficiency;
+        }
+        /* the moved cores may be asleep on partition 0 */
+        m_partitions[0].event.Notify(true);
+        m_partitions[0].efficiencyEvent.Notify(true);
+
+        return partition;
+    }
+
+    /* Index of the partition with the given name, -1 if there's none */
+    int FindPartition(const std::string& name)
+    {
+        std::unique_lock<std::mutex> lock(m_partitionMutex);
+        for (unsigned p = 1; p < m_numPartitions; ++p) {
+            if (m_partitions[p].name == name)
+                return p;
+        }
+        return -1;
     }
 
     /* if finishQueue is set, cores will termianate after handling every job at the queue
-    if not, they will finish the current job they have and terminate. */
+    if not, they will finish the current job they have and terminate, the rest of the
+    queue is dropped. */
     void Close(const bool finishQueue = true)
     {
-        {
-            std::unique_lock<std::mutex> lock(m_queueMutex);
-            m_terminate = 1;
-            m_waitToFinish = finishQueue;
-            m_queueToCoreNotifier.notify_all();
+        m_waitToFinish = finishQueue;
+        m_terminate = 1;
+        for (unsigned p = 0; p < m_numPartitions; ++p) {
+            m_partitions[p].event.Notify(true);
+            m_partitions[p].efficiencyEvent.Notify(true);
         }
 
         for (int i = 0; i < m_numCoreHandlers; ++i) {
@@ -134,6 +407,15 @@ public:
                 m_coreHandlerThreads[i].join();
         }
 
+        /* jobs left in the queues are dropped, they count as handled s.t Wait() and
+        WaitBatch() don't wait for them forever */
+        std::shared_ptr<PoolJob> dropped;
+        for (unsigned p = 0; p < m_numPartitions; ++p) {
+            while (PopJob(p, 0, dropped)) {
+                JobDone(dropped->batch);
+            }
+        }
+
         /* free doesn't call the destructor, so  */
         for (int i = 0; i < m_numCoreHandlers; ++i) {
             m_coreHandlers[i].~CoreHandler();
@@ -152,6 +434,71 @@ public:
         return m_numThreadsPerCore;
     }
 
+    /* Whether the calling thread is one of this pool's core or thread handlers */
+    bool IsWorkerThread()
+    {
+        return t_workerOf == this;
+    }
+
+    /* Core handler the calling thread runs jobs for, -1 if it's not a thread of this
+    pool. Lets dependent work follow the core that produced its input. */
+    int CurrentCoreHandler()
+    {
+        return t_workerOf == this ? t_coreHandler : -1;
+    }
+
+    /* Number of jobs added and not handled yet, queued or running */
+    const unsigned NumPendingJobs()
+    {
+        std::unique_lock<std::mutex> lock(m_doneMutex);
+        return m_numPendingJobs;
+    }
+
+    /* Number of jobs queued to a partition that no core has picked up yet */
+    const unsigned NumQueuedJobs(const unsigned partition)
+    {
+        if (partition >= m_numPartitions)
+            return 0;
+        const int numQueued = QueuedJobs(partition);
+        return numQueued > 0 ? numQueued : 0;
+    }
+
+    /* Number of core handlers taking the jobs of a partition */
+    const unsigned NumCoresOfPartition(const unsigned partition)
+    {
+        if (partition >= m_numPartitions)
+            return 0;
+        return m_partitions[partition].numCores;
+    }
+
+    const unsigned NumGroups()
+    {
+        return m_numGroups;
+    }
+
+    /* CPUUtil index of the hardware core the Nth core handler runs on */
+    const unsigned HWCoreOfHandler(const unsigned n)
+    {
+        return n < m_numCoreHandlers ? m_coreHandlers[n].m_hwCore : 0;
+    }
+
+    /* Partition of the Nth core handler */
+    const unsigned PartitionOfCore(const unsigned n)
+    {
+        return n < m_numCoreHandlers ? m_coreHandlers[n].m_partition.load() : 0;
+    }
+
+    /* Core group of the Nth core handler, the index of its L3 domain */
+    const unsigned GroupOfCore(const unsigned n)
+    {
+        return n < m_numCoreHandlers ? m_coreHandlers[n].m_group : 0;
+    }
+
+    const unsigned NumCoreHandlers()
+    {
+        return m_numCoreHandlers;
+    }
+
     template <typename F, typename... Args>
     static std::function<void()> WrapFunc(F&& f, Args&&... args)
     {
@@ -166,49 +513,294 @@ public:
     }
 
 protected:
-    template <typename T> class Queue {
+    /* A queued job, the functions for the threads of a core and its batch */
+    struct PoolJob {
+        std::vector<std::function<void()>> funcs;
+        JobBatch* batch;
+        unsigned partition, group;
+        int priority;
+        /* set by whoever takes the job, a core or WaitBatch */
+        std::atomic<int> claimed{0};
+    };
+
+    /* Called after each job, wakes up Wait() on the last one, WaitBatch() once
+    the batch is down to the pending jobs its waiters wait for. The batch may be gone
+    as soon as the lock is released. */
+    void JobDone(JobBatch* const batch)
+    {
+        std::unique_lock<std::mutex> lock(m_doneMutex);
+        if (batch && --batch->numPending <= batch->wakeAt && batch->numWaiters > 0)
+            batch->waiters.notify_all();
+        if (--m_numPendingJobs == 0)
+            m_jobsDoneNotifier.notify_all();
+    }
+
+    /* Wake a core for a job queued to the partition, a performance core if one is
+    idle. It may take a job of another group, stealing it as any core would. */
+    void WakeCore(const unsigned partition)
+    {
+        Partition& queues = m_partitions[partition];
+        if (queues.event.NumWaiters() > 0 ||
+            queues.numPerformanceCores == queues.numCores) {
+            queues.event.Notify(false);
+        } else {
+            queues.efficiencyEvent.Notify(false);
+        }
+    }
+
+    /* Take a queued job, false if it's taken already */
+    bool Claim(PoolJob& job)
+    {
+        int expected = 0;
+        if (!job.claimed.compare_exchange_strong(expected, 1))
+            return false;
+        --m_partitions[job.partition].numQueued;
+        return true;
+    }
+
+    /* Put a job a core popped back into its queue, unclaimed, e.g when the core was
+    moved to another partition meanwhile */
+    void Requeue(std::shared_ptr<PoolJob> job)
+    {
+        const unsigned partition = job->partition;
+        Partition& queues = m_partitions[partition];
+        ++queues.numQueued;
+        job->claimed = 0;
+        if (job->batch) {
+            std::unique_lock<std::mutex> lock(m_doneMutex);
+            job->batch->queued.push_back(job);
+            if (job->batch->numWaiters > 0)
+                job->batch->waiters.notify_one();
+        }
+        const int priority = job->priority;
+        queues.queues[job->group % m_numGroups].Push(std::move(job), priority);
+        WakeCore(partition);
+    }
+
+    /* Number of unclaimed jobs in the queues of a partition */
+    int QueuedJobs(const unsigned partition)
+    {
+        return m_partitions[partition].numQueued;
+    }
+
+    /* Whether a core takes a job now. Efficiency cores leave as many queued jobs as
+    there are idle performance cores in the partition (asleep on its event, or about
+    to be) to them, unless the pool is closing. Busy performance cores don't count,
+    jobs queued behind their long jobs go to the efficiency cores. */
+    bool TakesJobs(const bool efficiency, const unsigned partition)
+    {
+        return !efficiency || m_terminate ||
+               QueuedJobs(partition) > m_partitions[partition].event.NumWaiters();
+    }
+
+    /* Pop a job from the given group's queue of the partition, or steal one from its
+    other groups, the highest priority class first. Jobs claimed by WaitBatch while
+    queued are dropped on the way. */
+    bool PopJob(const unsigned partition, const unsigned group,
+                std::shared_ptr<PoolJob>& job)
+    {
+        for (int priority = NUM_PRIORITIES - 1; priority >= 0; --priority) {
+            for (unsigned g = 0; g < m_numGroups; ++g) {
+                Queue<std::shared_ptr<PoolJob>>& queue =
+                  m_partitions[partition].queues[(group + g) % m_numGroups];
+                while (queue.Pop(job, priority)) {
+                    if (Claim(*job))
+                        return true;
+                }
+            }
+        }
+        job.reset();
+        return false;
+    }
+
+    /*
+     * Bounded multi producer multi consumer ring buffer (D. Vyukov's), lock free
+     * for producers and consumers that aren't preempted mid operation. Each cell has
+     * a sequence number telling whether it's free for the producer at a position or
+     * filled for the consumer at it, the positions are claimed with a CAS.
+     */
+    template <typename T, unsigned Capacity> class Ring {
     public:
-        Queue()
+        static_assert((Capacity & (Capacity - 1)) == 0, "Capacity is a power of 2");
+
+        Ring()
         {
+            for (unsigned i = 0; i < Capacity; ++i) {
+                m_cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
         }
-        ~Queue()
+
+        /* false if the ring is full, element is left untouched then */
+        bool Push(T& element)
         {
+            size_t pos = m_pushPos.load(std::memory_order_relaxed);
+            Cell* cell;
+            while (1) {
+                cell = &m_cells[pos & (Capacity - 1)];
+                const size_t seq = cell->sequence.load(std::memory_order_acquire);
+                const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                if (diff == 0) {
+                    if (m_pushPos.compare_exchange_weak(pos, pos + 1,
+                                                        std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = m_pushPos.load(std::memory_order_relaxed);
+                }
+            }
+            cell->element = std::move(element);
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            return true;
         }
 
-        void Push(T const& element)
+        /* false if the ring is empty */
+        bool Pop(T& element)
         {
-            std::unique_lock<std::mutex> lock(m_mutex);
-            m_queue.push(std::move(element));
+            size_t pos = m_popPos.load(std::memory_order_relaxed);
+            Cell* cell;
+            while (1) {
+                cell = &m_cells[pos & (Capacity - 1)];
+                const size_t seq = cell->sequence.load(std::memory_order_acquire);
+                const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+                if (diff == 0) {
+                    if (m_popPos.compare_exchange_weak(pos, pos + 1,
+                                                       std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = m_popPos.load(std::memory_order_relaxed);
+                }
+            }
+            element = std::move(cell->element);
+            cell->sequence.store(pos + Capacity, std::memory_order_release);
+            return true;
         }
 
-        bool Pop(T& function)
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T element;
+        };
+        /* the positions are on cache lines of their own, producers and consumers
+        don't invalidate each other's */
+        alignas(64) std::atomic<size_t> m_pushPos{0};
+        alignas(64) std::atomic<size_t> m_popPos{0};
+        alignas(64) Cell m_cells[Capacity];
+    };
+
+    /*
+     * Event count the idle cores of a partition sleep on. A core takes a key with
+     * PrepareWait, looks at the queues a last time and sleeps in Wait(key) only if
+     * nothing was notified since it took the key, s.t a job added between its look
+     * and its sleep isn't missed. Notify takes no lock unless a core is waiting.
+     */
+    class EventCount {
+    public:
+        uint64_t PrepareWait()
         {
-            std::unique_lock<std::mutex> lock(m_mutex);
-            if (!m_queue.empty()) {
-                function = std::move(m_queue.front());
-                m_queue.pop();
-                return true;
+            ++m_numWaiters;
+            return m_epoch.load();
+        }
+
+        void CancelWait()
+        {
+            --m_numWaiters;
+        }
+
+        /* cores waiting or about to */
+        int NumWaiters()
+        {
+            return m_numWaiters.load();
+        }
+
+        void Wait(const uint64_t key)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (m_epoch.load() == key) {
+                    m_notifier.wait(lock);
+                }
             }
-            return false;
+            --m_numWaiters;
         }
 
-        int Size()
+        /* wake one waiting core, or all of them */
+        void Notify(const bool all)
         {
-            std::unique_lock<std::mutex> lock(m_mutex);
-            return m_queue.size();
+            ++m_epoch;
+            if (m_numWaiters.load() > 0) {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                if (all)
+                    m_notifier.notify_all();
+                else
+                    m_notifier.notify_one();
+            }
         }
 
     private:
-        std::queue<T> m_queue;
+        std::atomic<uint64_t> m_epoch{0};
+        std::atomic<int> m_numWaiters{0};
         std::mutex m_mutex;
+        std::condition_variable m_notifier;
+    };
+
+    /* Jobs a queue holds per priority class before spilling */
+    static constexpr unsigned QUEUE_CAPACITY = 1024;
+
+    /* FIFO per priority class, a lock free ring, elements pushed while it's full (or
+    while older ones are spilled) go to a locked list behind it */
+    template <typename T> class Queue {
+    public:
+        void Push(T element, const int priority = PRIORITY_NORMAL)
+        {
+            Level& level = m_levels[priority];
+            if (level.numSpilled == 0 && level.ring.Push(element))
+                return;
+            std::unique_lock<std::mutex> lock(level.spillMutex);
+            level.spilled.push_back(std::move(element));
+            ++level.numSpilled;
+        }
+
+        /* Pop the first element of the given priority */
+        bool Pop(T& element, const int priority)
+        {
+            Level& level = m_levels[priority];
+            if (level.ring.Pop(element))
+                return true;
+            if (level.numSpilled == 0)
+                return false;
+            std::unique_lock<std::mutex> lock(level.spillMutex);
+            if (level.spilled.empty())
+                return false;
+            element = std::move(level.spilled.front());
+            level.spilled.pop_front();
+            --level.numSpilled;
+            return true;
+        }
+
+    private:
+        struct Level {
+            Ring<T, QUEUE_CAPACITY> ring;
+            std::atomic<unsigned> numSpilled{0};
+            std::mutex spillMutex;
+            std::deque<T> spilled;
+        };
+        Level m_levels[NUM_PRIORITIES];
     };
 
     class CoreHandler {
     public:
         CoreHandler(HWLocalThreadPool* const _parent, const unsigned _id,
-                    const ULONG_PTR& _processorMask)
-            : m_parent(_parent), m_id(_id), m_processorAffinityMask(_processorMask),
-              m_terminate(false), m_numChildThreads(_parent->m_numThreadsPerCore - 1)
+                    const unsigned _hwCore, const ULONG_PTR& _processorMask,
+                    const unsigned _group, const bool _efficiency)
+            : m_parent(_parent), m_id(_id), m_hwCore(_hwCore),
+              m_processorAffinityMask(_processorMask), m_group(_group),
+              m_efficiency(_efficiency), m_terminate(false),
+              m_numChildThreads(min(_parent->m_numThreadsPerCore,
+                                    (unsigned)CPUUtil::GetNumCoreThreads(_hwCore)) -
+                                1)
         {
             if (m_numChildThreads > 0) {
                 m_childThreads = new std::thread[m_numChildThreads];
@@ -240,6 +832,16 @@ protected:
             }
         }
 
+        /* Run the functions of the job meant for the pool's threads this core lacks */
+        void RunExtraFunctions()
+        {
+            const unsigned numFuncs =
+              min((unsigned)m_job.size(), m_parent->m_numThreadsPerCore);
+            for (unsigned i = m_numChildThreads + 1; i < numFuncs; ++i) {
+                m_job[i]();
+            }
+        }
+
         void CloseChildThreads()
         {
             if (m_terminate || m_numChildThreads < 1)
@@ -265,23 +867,45 @@ protected:
         void operator()()
         {
             SetThreadAffinityMask(GetCurrentThread(), m_processorAffinityMask);
-            bool dequeued;
+            t_workerOf = m_parent;
+            t_coreHandler = m_id;
             while (1) {
-                {
-                    std::unique_lock<std::mutex> lock(m_parent->m_queueMutex);
-                    if (m_parent->m_terminate &&
-                        !(m_parent->m_waitToFinish && m_parent->m_queue.Size() > 0)) {
-                        break;
-                    }
-                    if (m_parent->m_queue.Size() == 0) {
-                        m_parent->m_queueToCoreNotifier.wait(lock);
-                    }
-                    dequeued = m_parent->m_queue.Pop(m_job);
+                const unsigned partition = m_partition;
+                /* Close(false) drops the queue, Close() lets it drain first */
+                if (m_parent->m_terminate &&
+                    !(m_parent->m_waitToFinish &&
+                      m_parent->QueuedJobs(partition) > 0)) {
+                    break;
                 }
-                if (dequeued) {
+                const bool dequeued = m_parent->TakesJobs(m_efficiency, partition) &&
+                                      m_parent->PopJob(partition, m_group, m_poolJob);
+                if (dequeued && m_partition != partition) {
+                    /* AddPartition moved the core while it popped, the job belongs
+                    to the cores left in the old partition */
+                    m_parent->Requeue(std::move(m_poolJob));
+                } else if (!dequeued) {
+                    /* sleep unless a job, a move or the close came after the key */
+                    Partition& queues = m_parent->m_partitions[partition];
+                    EventCount& event =
+                      m_efficiency ? queues.efficiencyEvent : queues.event;
+                    const uint64_t key = event.PrepareWait();
+                    if (m_parent->m_terminate || m_partition != partition ||
+                        (m_parent->QueuedJobs(partition) > 0 &&
+                         m_parent->TakesJobs(m_efficiency, partition))) {
+                        event.CancelWait();
+                    } else {
+                        /* an efficiency core woken for jobs it leaves to the
+                        performance cores passes the wake up on to them */
+                        if (m_efficiency && m_parent->QueuedJobs(partition) > 0)
+                            queues.event.Notify(false);
+                        event.Wait(key);
+                    }
+                } else {
+                    m_job = std::move(m_poolJob->funcs);
                     m_ownJob = std::move(m_job[0]);
                     if (m_numChildThreads < 1) {
                         m_ownJob();
+                        RunExtraFunctions();
                     } else {
                         {
                             std::unique_lock<std::mutex> lock(m_threadMutex);
@@ -294,7 +918,10 @@ protected:
                         m_ownJob();
 
                         WaitForChildThreads();
+                        RunExtraFunctions();
                     }
+                    m_parent->JobDone(m_poolJob->batch);
+                    m_poolJob.reset();
                 }
             }
             CloseChildThreads();
@@ -312,6 +939,8 @@ protected:
             void operator()()
             {
                 SetThreadAffinityMask(GetCurrentThread(), m_processorAffinityMask);
+                t_workerOf = m_parent->m_parent;
+                t_coreHandler = m_parent->m_id;
                 while (1) {
                     {
                         std::unique_lock<std::mutex> lock(m_parent->m_threadMutex);
@@ -344,14 +973,22 @@ protected:
         };
 
         const unsigned m_id;
+        /* index of the hardware core in CPUUtil */
+        const unsigned m_hwCore;
         HWLocalThreadPool* const m_parent;
         const ULONG_PTR m_processorAffinityMask;
+        const unsigned m_group;
+        /* efficiency core of a hybrid CPU */
+        const bool m_efficiency;
+        /* partition the core takes jobs from, moved by AddPartition */
+        std::atomic<unsigned> m_partition{0};
         const unsigned m_numChildThreads;
 
         std::thread* m_childThreads;
         bool* m_childThreadOnline;
         bool m_terminate;
 
+        std::shared_ptr<PoolJob> m_poolJob;
         std::vector<std::function<void()>> m_job;
         std::function<void()> m_ownJob;
 
@@ -361,14 +998,63 @@ protected:
     };
 
 private:
-    unsigned m_numHWCores, m_numCoreHandlers, m_numThreadsPerCore;
+    unsigned m_numHWCores, m_numCoreHandlers, m_numThreadsPerCore, m_numGroups;
     CoreHandler* m_coreHandlers;
     std::thread* m_coreHandlerThreads;
 
-    Queue<std::vector<std::function<void()>>> m_queue;
+    /* A named set of cores with a job queue per core group */
+    struct Partition {
+        std::string name;
+        std::atomic<unsigned> numCores{0}, numPerformanceCores{0};
+        /* unclaimed jobs in the queues */
+        std::atomic<int> numQueued{0};
+        std::unique_ptr<Queue<std::shared_ptr<PoolJob>>[]> queues;
+        /* idle cores of the partition sleep on these, performance cores (every core
+        of a CPU that isn't hybrid) on event, efficiency cores on efficiencyEvent */
+        EventCount event, efficiencyEvent;
+    };
+    /* a slot per core handler, the first m_numPartitions are in use */
+    std::unique_ptr<Partition[]> m_partitions;
+    std::atomic<unsigned> m_numPartitions{0};
+    /* serializes AddPartition and FindPartition */
+    std::mutex m_partitionMutex;
+
+    std::atomic<bool> m_terminate, m_waitToFinish;
 
-    bool m_terminate, m_waitToFinish;
+    unsigned m_numPendingJobs = 0;
+    /* pool the calling thread belongs to, if any */
+    static inline thread_local HWLocalThreadPool* t_workerOf = NULL;
+    static inline thread_local int t_coreHandler = -1;
+    std::mutex m_doneMutex;
+    std::condition_variable m_jobsDoneNotifier;
+};
 
-    std::mutex m_queueMutex;
-    std::condition_variable m_queueToCoreNotifier;
+#ifdef __cpp_impl_coroutine
+/*
+ * Fire and forget coroutine for pipelines on the pool, e.g
+ *   PoolTask Pipeline(HWLocalThreadPool& pool) { co_await pool.Schedule(); ... }
+ * It starts on the calling thread and runs until its first suspension, continues on
+ * the pool thread resuming it and frees its frame once it returns.
+ */
+struct PoolTask {
+    struct promise_type {
+        PoolTask get_return_object() noexcept
+        {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
 };
+#endif